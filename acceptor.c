@@ -0,0 +1,150 @@
+// acceptor.c: TCP accept threads and their hand-off queue to the reactor
+
+#define _GNU_SOURCE  // accept4()
+
+#include "acceptor.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#define ACCEPT_RETRY_US 100000  // Back-off when accept() runs out of descriptors or memory
+
+// One accept thread and its listening socket
+typedef struct {
+    pthread_t thread;
+    int listen_fd;
+    unsigned long accepted;  // Only touched by the thread until it is joined
+} acceptor_t;
+
+static acceptor_t acceptors[ACCEPTOR_MAX];
+static int acceptor_count;
+static int event_fd = -1;    // Readable while the queue has sockets for the reactor
+static int running;
+
+// Ring of accepted sockets, oldest at queue_head
+static accepted_t queue[ACCEPTOR_QUEUE_SIZE];
+static int queue_head;
+static int queue_count;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+
+// Accept thread: take connections off this thread's socket and queue them.
+// While the queue is full, new connections wait in the kernel's backlog.
+static void *accept_loop(void *arg) {
+    acceptor_t *a = arg;
+    uint64_t one = 1;
+
+    while (1) {
+        accepted_t c;
+        socklen_t len = sizeof(c.addr);
+
+        c.fd = accept4(a->listen_fd, (struct sockaddr *)&c.addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c.fd < 0) {
+            pthread_mutex_lock(&lock);
+            int stop = !running;
+            pthread_mutex_unlock(&lock);
+            if (stop) {
+                break;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                syslog(LOG_ERR, "Accept failed: %s", strerror(errno));
+                usleep(ACCEPT_RETRY_US);
+            }
+            continue;
+        }
+        int nodelay = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        pthread_mutex_lock(&lock);
+        while (running && queue_count == ACCEPTOR_QUEUE_SIZE) {
+            pthread_cond_wait(&room, &lock);
+        }
+        if (!running) {
+            pthread_mutex_unlock(&lock);
+            close(c.fd);
+            break;
+        }
+        queue[(queue_head + queue_count) % ACCEPTOR_QUEUE_SIZE] = c;
+        queue_count++;
+        pthread_mutex_unlock(&lock);
+
+        a->accepted++;
+        write(event_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+// Open count listening sockets and start a thread on each. Returns the
+// eventfd the reactor waits on, or -1.
+int acceptor_start(int count, acceptor_listen_fn open_listener) {
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        return -1;
+    }
+    running = 1;
+    for (acceptor_count = 0; acceptor_count < count && acceptor_count < ACCEPTOR_MAX; acceptor_count++) {
+        acceptor_t *a = &acceptors[acceptor_count];
+        a->listen_fd = open_listener();
+        a->accepted = 0;
+        if (pthread_create(&a->thread, NULL, accept_loop, a) != 0) {
+            close(a->listen_fd);
+            acceptor_stop();
+            return -1;
+        }
+    }
+    return event_fd;
+}
+
+// Move up to max queued connections to out; returns how many. The reactor
+// calls it when the eventfd is readable, until it returns less than max.
+int acceptor_take(accepted_t *out, int max) {
+    uint64_t pending;
+    int n = 0;
+
+    read(event_fd, &pending, sizeof(pending));  // Later hand-offs make it readable again
+    pthread_mutex_lock(&lock);
+    while (n < max && queue_count > 0) {
+        out[n++] = queue[queue_head];
+        queue_head = (queue_head + 1) % ACCEPTOR_QUEUE_SIZE;
+        queue_count--;
+    }
+    if (n > 0) {
+        pthread_cond_broadcast(&room);
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void acceptor_stop(void) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&room);
+    pthread_mutex_unlock(&lock);
+
+    // Shutting a listening socket down wakes the thread blocked in accept()
+    for (int i = 0; i < acceptor_count; i++) {
+        shutdown(acceptors[i].listen_fd, SHUT_RDWR);
+        pthread_join(acceptors[i].thread, NULL);
+        close(acceptors[i].listen_fd);
+        syslog(LOG_INFO, "Acceptor %d: %lu connections", i, acceptors[i].accepted);
+    }
+    acceptor_count = 0;
+
+    for (; queue_count > 0; queue_count--) {
+        close(queue[queue_head].fd);
+        queue_head = (queue_head + 1) % ACCEPTOR_QUEUE_SIZE;
+    }
+    close(event_fd);
+    event_fd = -1;
+}
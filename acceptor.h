@@ -0,0 +1,31 @@
+// acceptor.h: TCP accept threads for yashd
+//
+// Each thread blocks in accept() on a listening socket of its own, all of
+// them bound to the server port with SO_REUSEPORT, so the kernel spreads a
+// connection storm over their accept queues and the accepts run alongside
+// the reactor. Accepted sockets are handed to the reactor, which owns every
+// session, through a queue whose eventfd it waits on.
+
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <netinet/in.h>
+
+#define ACCEPTOR_MAX 16           // Accept threads, and so listening sockets on the port
+#define ACCEPTOR_QUEUE_SIZE 1024  // Accepted sockets the reactor has yet to take
+
+// A connection accepted on a thread; the socket is non-blocking,
+// close-on-exec and has TCP_NODELAY set
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+} accepted_t;
+
+// Opens one listening socket on the server port with SO_REUSEPORT
+typedef int (*acceptor_listen_fn)(void);
+
+int acceptor_start(int count, acceptor_listen_fn open_listener);
+int acceptor_take(accepted_t *out, int max);
+void acceptor_stop(void);
+
+#endif
@@ -4,155 +4,846 @@
 #include <unistd.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "proto.h"
 
 #define PORT 3822
 #define BUFFER_SIZE 1024
+#define STREAM_CHUNK PROTO_MAX_PAYLOAD  // Keystroke bytes per KEYS frame, stdin bytes per DATA frame
+#define ESCAPE_CHAR 0x1d                // Ctrl-]: leave the shell for a local command
+#define RECONNECT_TRIES 30              // Attempts to get back to a detached session
+#define RECONNECT_DELAY_SEC 2
+
+// One shell multiplexed over the connection, as the client sees it
+typedef struct {
+    char token[64];                // From MSG_SESSION; empty if the server sent none
+    unsigned long long received;   // Shell output bytes seen, the offset to resume from
+    unsigned long long end;        // Output the server had buffered when we reattached
+    int attaching;                 // MSG_ATTACH sent and not answered: output is not ours yet
+    proto_inflater_t inflater;
+} channel_t;
 
 int sockfd;
+frame_reader_t reader;  // Reassembles frames from the server
+int stats_received;     // A MSG_STATS answer has been printed
+int want_zlib;          // -z: ask the server to compress output
+const char *server_ip;     // IPv4 address, or the path of yashd's Unix socket
+struct termios saved_tio;  // Terminal settings to restore on the way out
+int tio_saved;
+channel_t *channels[PROTO_MAX_CHANNELS];  // Open channels; the server starts channel 0
+int current;                              // Channel commands and signals go to
+
+// Batch mode: a whole script is streamed up front and results are printed
+// as the shell finishes each line. Commands piped in without -f run the
+// same way.
+int batch_fd = -1;                 // Script being run, -1 when interactive
+int batch_quiet;                   // Piped commands on stdin: no "[N] exit S" lines
+unsigned long batch_lines;         // Script lines read; a line's number is its seq
+unsigned long batch_sent;          // Non-blank lines sent
+unsigned long batch_done;          // Lines whose end mark has arrived
+unsigned long batch_failed;        // ... with a non-zero exit status
+int batch_inside;                  // Output is between a begin and an end mark
+char batch_last = '\n';            // Last output byte printed
+char batch_mark[PROTO_MARK_MAX];   // Possible mark split across frames
+size_t batch_mark_len;
+
+// Where yashd listens: an address with a '/' is the path of its Unix
+// socket for local clients, anything else an IPv4 address for the TCP port.
+// Returns -1 if the address is not usable.
+int server_address(const char *address, struct sockaddr_storage *sa, socklen_t *len) {
+    memset(sa, 0, sizeof(*sa));
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un *un = (struct sockaddr_un *)sa;
+        if (strlen(address) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address);
+        *len = sizeof(*un);
+        return 0;
+    }
+    struct sockaddr_in *in = (struct sockaddr_in *)sa;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(PORT);
+    *len = sizeof(*in);
+    return inet_pton(AF_INET, address, &in->sin_addr) <= 0 ? -1 : 0;
+}
 
-// Function to connect to the server
-int server_connect(const char *ip_address) {
-    struct sockaddr_in server_addr;
+// Open a connection to yashd. Returns the socket, or -1 on failure.
+int open_connection(const char *address) {
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
 
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        printf("Socket creation failed");
-        exit(EXIT_FAILURE);
+    if (server_address(address, &server_addr, &addr_len) < 0) {
+        return -1;
+    }
+    int fd = socket(server_addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&server_addr, addr_len) < 0) {
+        close(fd);
+        return -1;
     }
 
-    // Set server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = ntohs(htons(PORT));
+    // Keystroke frames are tiny and must not wait on Nagle
+    if (server_addr.ss_family == AF_INET) {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    return fd;
+}
+
+// Function to connect to the server
+int server_connect(const char *address) {
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
 
-    // Convert IP address
-    if (inet_pton(AF_INET, ip_address, &server_addr.sin_addr) <= 0) {
+    // Convert the address
+    if (server_address(address, &server_addr, &addr_len) < 0) {
         printf("Invalid address or Address not supported");
         exit(EXIT_FAILURE);
     }
 
     // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    sockfd = open_connection(address);
+    if (sockfd < 0) {
         printf("Connection to server failed");
         exit(EXIT_FAILURE);
     }
 
-    printf("Connected to server at %s:%d\n", ip_address, PORT);
+    if (batch_fd < 0 && server_addr.ss_family == AF_UNIX) {
+        printf("Connected to server at %s\nEscape character is '^]'.\n", address);
+    } else if (batch_fd < 0) {
+        printf("Connected to server at %s:%d\nEscape character is '^]'.\n", address, PORT);
+    }
     return sockfd;
 }
 
 // Function to handle quitting the client (Ctrl-D or "quit" command)
 void handle_quit(int sig) {
     printf("Quitting the client...\n");
+    proto_send(sockfd, MSG_CTL, current, "q", 1);  // End the session rather than leave it detached
     close(sockfd);
     exit(0);
 }
 
 // Function to handle sending Ctrl-C (SIGINT) to the server
 void handle_sigint(int sig) {
-    char ctl_message[] = "CTL c\n";  // Send control message for Ctrl-C
-    send(sockfd, ctl_message, strlen(ctl_message), 0);
+    proto_send(sockfd, MSG_CTL, current, "c", 1);  // Send control message for Ctrl-C
 }
 
 // Function to handle sending Ctrl-Z (SIGTSTP) to the server
 void handle_sigtstp(int sig) {
-    char ctl_message[] = "CTL z\n";  // Send control message for Ctrl-Z
-    send(sockfd, ctl_message, strlen(ctl_message), 0);
+    proto_send(sockfd, MSG_CTL, current, "z", 1);  // Send control message for Ctrl-Z
+}
+
+// Start tracking a channel the server opened (or will open) for us
+channel_t *channel_add(int id) {
+    channel_t *ch = calloc(1, sizeof(channel_t));
+    if (ch == NULL) {
+        return NULL;
+    }
+    if (want_zlib) {
+        proto_inflate_init(&ch->inflater);
+    }
+    channels[id] = ch;
+    return ch;
 }
 
-// Function to send command to server using the CMD protocol
-void send_command(char *command) {
-    char buffer[BUFFER_SIZE];
+// The channel's shell is gone
+void channel_drop(int id) {
+    proto_inflate_end(&channels[id]->inflater);
+    free(channels[id]);
+    channels[id] = NULL;
+}
 
-    // Format the command to match the CMD protocol
-    snprintf(buffer, sizeof(buffer), "CMD %s\n", command);
-    send(sockfd, buffer, strlen(buffer), 0);
+// Lowest channel id in use (or free), -1 if there is none
+int channel_find(int in_use) {
+    for (int id = 0; id < PROTO_MAX_CHANNELS; id++) {
+        if ((channels[id] != NULL) == in_use) {
+            return id;
+        }
+    }
+    return -1;
 }
 
-// Function to handle multiline input for commands like "cat" and "wc"
-void send_multiline_input() {
-    char buffer[BUFFER_SIZE] = {0};  // Initialize buffer
-    char input_line[BUFFER_SIZE];
+void batch_output(const char *data, size_t len);
 
-    // Read multiline input until EOF
-    while (fgets(input_line, sizeof(input_line), stdin) != NULL) {
-        strncat(buffer, input_line, sizeof(buffer) - strlen(buffer) - 1);
+// Write shell output and count it
+void print_output(const char *data, size_t len, void *arg) {
+    channel_t *ch = arg;
+
+    if (batch_fd >= 0) {
+        batch_output(data, len);
+    } else {
+        fwrite(data, 1, len, stdout);
     }
+    ch->received += len;
+}
 
-    // After receiving Ctrl-D (EOF), send the accumulated buffer to the server
-    send(sockfd, buffer, strlen(buffer), 0);
+// Answer to a reattach request: resume the channel's output count from
+// where the server replays, or give the channel up
+void attach_reply(const frame_t *frame) {
+    channel_t *ch = channels[frame->channel];
+    char reply[64];
+    unsigned long long offset, end;
+
+    size_t len = frame->len < sizeof(reply) - 1 ? frame->len : sizeof(reply) - 1;
+    memcpy(reply, frame->payload, len);
+    reply[len] = '\0';
+    ch->attaching = 0;
+
+    // An empty answer means the session expired or was never kept
+    if (sscanf(reply, "%llu %llu", &offset, &end) != 2) {
+        printf("[channel %d lost]\n", frame->channel);
+        channel_drop(frame->channel);
+        return;
+    }
+    if (offset > ch->received) {
+        printf("[%llu bytes of output lost on channel %d]\n", offset - ch->received, frame->channel);
+    }
+    ch->received = offset;
+    ch->end = end;
 }
 
-// Main client loop for reading commands and receiving responses
-void client_loop() {
-    char buffer[BUFFER_SIZE];  // Buffer to store server responses
-    char command[BUFFER_SIZE]; // Buffer to store client commands
-    int bytes_read;
+// Print every complete frame already buffered. Returns -1 on a malformed stream.
+int print_frames() {
+    frame_t frame;
+    int printed = 0;
+    int rc;
 
-    while (1) {
-        // Read server output (including prompt)
-        memset(buffer, 0, sizeof(buffer));
-        bytes_read = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_read <= 0) {
-            printf("Server disconnected or error occurred.\n");
-            break;
+    while ((rc = proto_next(&reader, &frame)) > 0) {
+        channel_t *ch = frame.channel < PROTO_MAX_CHANNELS ? channels[frame.channel] : NULL;
+        if (ch == NULL) {
+            continue;  // Closed, or the spare shell a reconnect starts with
         }
+        if (frame.type == MSG_ATTACH && ch->attaching) {
+            attach_reply(&frame);
+        } else if (ch->attaching) {
+            continue;  // Still the spare shell's output, not our session's
+        } else if (frame.type == MSG_OUT && frame.len > 0) {
+            print_output(frame.payload, frame.len, ch);
+            printed |= (frame.channel == current);
+        } else if (frame.type == MSG_ZOUT) {
+            if (proto_inflate(&ch->inflater, &frame, print_output, ch) < 0) {
+                return -1;
+            }
+            printed |= (frame.channel == current);
+        } else if (frame.type == MSG_STATS) {
+            fwrite(frame.payload, 1, frame.len, stdout);
+            stats_received = 1;
+        } else if (frame.type == MSG_SESSION && frame.len < sizeof(ch->token)) {
+            memcpy(ch->token, frame.payload, frame.len);
+            ch->token[frame.len] = '\0';
+        } else if (frame.type == MSG_CLOSE) {
+            channel_drop(frame.channel);
+        } else if (frame.type == MSG_QUEUE) {
+            // Every session slot is taken; the shell starts when one frees up
+            fprintf(stderr, "Server busy, waiting for a session (position %.*s)\n", (int)frame.len, frame.payload);
+        }
+    }
+    if (printed) {
+        fflush(stdout);
+    }
+    return (rc < 0) ? -1 : printed;
+}
 
-        // Display the server's output, including the prompt
-        printf("%s", buffer);  // Print the server's response
+// Ask the server for its counters and print them. The shell never sees the
+// request, so no prompt follows; the caller redraws it.
+int request_stats() {
+    stats_received = 0;
+    if (proto_send(sockfd, MSG_CTL, current, "s", 1) < 0) {
+        return -1;
+    }
+    while (!stats_received) {
+        ssize_t bytes_read = proto_reader_fill(&reader, sockfd);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0 || print_frames() < 0) {
+            return -1;
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// The connection dropped: connect again and attach every channel to the
+// session the server kept alive for it, asking for the output we have not
+// seen. Output of a channel is skipped until its attach answer arrives, as
+// the new connection starts out with a spare shell on channel 0.
+// Returns -1 if no session could be recovered.
+int reattach() {
+    char request[128];
+
+    if (channel_find(1) < 0) {
+        return -1;
+    }
+    close(sockfd);
 
-        // Read user input (command or text) and send it to the server
-        if (fgets(command, sizeof(command), stdin) == NULL) {
+    for (int tries = 0; tries < RECONNECT_TRIES; tries++) {
+        printf("\nConnection lost, reattaching...\n");
+        sleep(RECONNECT_DELAY_SEC);
+        sockfd = open_connection(server_ip);
+        if (sockfd < 0) {
             continue;
         }
 
-        // Remove newline at end if it exists
-        size_t len = strlen(command);
-        if (len > 0 && command[len - 1] == '\n') {
-            command[len - 1] = '\0';
+        reader.start = reader.end = 0;
+        int pending = 0;
+        for (int id = 0; id < PROTO_MAX_CHANNELS; id++) {
+            channel_t *ch = channels[id];
+            if (ch == NULL) {
+                continue;
+            }
+            if (ch->token[0] == '\0') {
+                channel_drop(id);
+                continue;
+            }
+            // The new connection's output starts uncompressed
+            if (want_zlib) {
+                proto_inflate_end(&ch->inflater);
+                proto_inflate_init(&ch->inflater);
+            }
+            int len = snprintf(request, sizeof(request), "%s %llu", ch->token, ch->received);
+            proto_send(sockfd, MSG_ATTACH, id, request, len);
+            ch->attaching = 1;
+            pending++;
+        }
+        if (pending == 0) {
+            return -1;
+        }
+        if (channels[0] == NULL) {
+            proto_send(sockfd, MSG_CLOSE, 0, NULL, 0);  // We have no use for the spare shell
+        }
+        if (want_zlib) {
+            proto_send(sockfd, MSG_HELLO, 0, "zlib", 4);
         }
 
-        // Special case for quitting
-        if (strcmp(command, "quit") == 0) {
-            handle_quit(0);  // Call the quit handler
+        // Wait for every answer; channels already back print their replay meanwhile
+        while (pending > 0) {
+            if (proto_reader_fill(&reader, sockfd) <= 0 || print_frames() < 0) {
+                break;
+            }
+            pending = 0;
+            for (int id = 0; id < PROTO_MAX_CHANNELS; id++) {
+                pending += (channels[id] != NULL && channels[id]->attaching);
+            }
         }
+        if (pending > 0) {
+            close(sockfd);
+            continue;
+        }
+        if (channel_find(1) < 0) {
+            return -1;
+        }
+        printf("Reattached to session\n");
+        return 0;
+    }
+    return -1;
+}
 
-        // Tokenize the command to check the first part (the actual command)
-        char *first_token = strtok(command, " ");
+// Client-side "chan" commands: list channels, "chan open" a new shell,
+// "chan close" the current one, or "chan <id>" to switch. Returns 0 to
+// redraw the prompt right away, 1 when it comes from elsewhere.
+int channel_command(const char *args) {
+    args += strspn(args, " ");
+
+    if (*args == '\0') {
+        for (int id = 0; id < PROTO_MAX_CHANNELS; id++) {
+            if (channels[id] != NULL) {
+                printf("%c %d\n", id == current ? '*' : ' ', id);
+            }
+        }
+        return 0;
+    }
+    if (strcmp(args, "open") == 0) {
+        int id = channel_find(0);
+        if (id < 0 || channel_add(id) == NULL) {
+            printf("No free channel\n");
+            return 0;
+        }
+        proto_send(sockfd, MSG_OPEN, id, NULL, 0);
+        current = id;
+        return 1;  // The new shell's prompt is on its way
+    }
+    if (strcmp(args, "close") == 0) {
+        proto_send(sockfd, MSG_CLOSE, current, NULL, 0);
+        channel_drop(current);
+        return 1;  // The loop moves on to another channel
+    }
 
-        // Check if the first part of the command is "cat" or "wc"
-        if (strcmp(first_token, "cat") == 0 || strcmp(first_token, "wc") == 0) {
-            // Send the "CMD cat" or "CMD wc" command to the server first
-            send_command(command);  // Send the full command
+    char *endp;
+    long id = strtol(args, &endp, 10);
+    if (*endp != '\0' || id < 0 || id >= PROTO_MAX_CHANNELS || channels[id] == NULL) {
+        printf("No such channel: %s\n", args);
+        return 0;
+    }
+    current = id;
+    return 0;
+}
 
-            // Then read multiline input from the user and send to the server
-            send_multiline_input();
-        } else {
-            // For other commands, send them in CMD format
-            send_command(command);
+// Output of a script line; everything outside the marks is dropped
+void batch_print(const char *data, size_t len) {
+    if (batch_inside && len > 0) {
+        fwrite(data, 1, len, stdout);
+        batch_last = data[len - 1];
+    }
+}
+
+// A complete mark, without its framing: "b<seq>" or "e<seq>;<status>"
+void batch_marked(const char *mark) {
+    unsigned long seq;
+    int status;
+
+    if (sscanf(mark, "b%lu", &seq) == 1) {
+        batch_inside = 1;
+        batch_last = '\n';
+    } else if (sscanf(mark, "e%lu;%d", &seq, &status) == 2) {
+        batch_inside = 0;
+        if (!batch_quiet && batch_last != '\n') {
+            putchar('\n');
+        }
+        if (!batch_quiet) {
+            printf("[%lu] exit %d\n", seq, status);
+        }
+        batch_done++;
+        if (status != 0) {
+            batch_failed++;
+        }
+    }
+}
+
+// Pick the begin/end marks out of a batch channel's output stream
+void batch_output(const char *data, size_t len) {
+    size_t prefix = strlen(PROTO_MARK);
+
+    while (len > 0) {
+        if (batch_mark_len == 0) {
+            const char *esc = memchr(data, PROTO_MARK[0], len);
+            size_t run = esc ? (size_t)(esc - data) : len;
+            batch_print(data, run);
+            data += run;
+            len -= run;
+            if (len == 0) {
+                break;
+            }
+        }
+
+        char c = *data++;
+        len--;
+        batch_mark[batch_mark_len++] = c;
+        if (batch_mark_len <= prefix) {
+            if (c != PROTO_MARK[batch_mark_len - 1]) {
+                batch_print(batch_mark, batch_mark_len);  // Some other escape sequence
+                batch_mark_len = 0;
+            }
+        } else if (c == PROTO_MARK_END[0]) {
+            batch_mark[batch_mark_len - 1] = '\0';
+            batch_mark_len = 0;
+            batch_marked(batch_mark + prefix);
+        } else if (batch_mark_len == sizeof(batch_mark) - 1) {
+            batch_print(batch_mark, batch_mark_len);
+            batch_mark_len = 0;
+        }
+    }
+}
+
+// Whether the command is "cat" or "wc" reading what is piped in: no <
+// redirection and no file operands (other than "-") in its first stage
+int reads_stdin(const char *command) {
+    char stage[BUFFER_SIZE];
+    char *save;
+    int files = 0, dash = 0;
+
+    size_t len = strcspn(command, "|&>");  // Words after '>' name the output file
+    if (len >= sizeof(stage)) {
+        return 0;
+    }
+    memcpy(stage, command, len);
+    stage[len] = '\0';
+    if (strchr(stage, '<') != NULL) {
+        return 0;
+    }
+
+    char *word = strtok_r(stage, " ", &save);
+    if (word == NULL || (strcmp(word, "cat") != 0 && strcmp(word, "wc") != 0)) {
+        return 0;
+    }
+    while ((word = strtok_r(NULL, " ", &save)) != NULL) {
+        if (strcmp(word, "-") == 0) {
+            dash = 1;
+        } else if (word[0] != '-') {
+            files++;
+        }
+    }
+    return files == 0 || dash;
+}
+
+// Run the script on batch_fd: send every line as soon as it is read, with
+// no waiting for the shell, and print results while sending. A line that
+// does not fit in one frame is reported and skipped, never split. Commands
+// piped in without -f go the same way, except that a "cat" or "wc" reading
+// stdin takes the rest of the input as a data stream: it goes out in DATA
+// frames, then EOF, and is cut short if the command finishes first.
+// Returns -1 if the connection or the shell went away before the last line
+// finished.
+int batch_run() {
+    static char script[PROTO_MAX_PAYLOAD - 32];
+    static char frame[PROTO_HDR_SIZE + PROTO_MAX_PAYLOAD];
+    size_t script_len = 0, frame_len = 0, frame_off = 0;
+    int at_eof = 0;
+    int too_long = 0;  // Dropping the rest of an over-long line
+    int stream = 0;    // 1 while the rest of the input is data, 2 once its EOF is framed
+
+    while (!at_eof || script_len > 0 || frame_off < frame_len || batch_done < batch_sent || stream == 1) {
+        if (stream && batch_done == batch_sent) {
+            at_eof = 1;  // The command is done reading: drop what it left
+            script_len = 0;
+            stream = 2;
+        }
+
+        char *nl = stream ? NULL : memchr(script, '\n', script_len);
+        if (!stream && (too_long || (nl == NULL && script_len == sizeof(script)))) {
+            if (!too_long) {
+                batch_lines++;
+                batch_failed++;
+                fprintf(stderr, "Line %lu is too long, skipped\n", batch_lines);
+                too_long = 1;
+            }
+            size_t used = nl ? (size_t)(nl - script) + 1 : script_len;
+            memmove(script, script + used, script_len - used);
+            script_len -= used;
+            too_long = (nl == NULL && !at_eof);
+            if (script_len > 0 || at_eof) {
+                continue;
+            }
+            nl = NULL;
+        }
+
+        // Frame the next line once the previous one is out
+        if (!stream && frame_off == frame_len && (nl != NULL || (script_len > 0 && at_eof))) {
+            size_t line_len = nl ? (size_t)(nl - script) : script_len;
+            size_t used = nl ? line_len + 1 : line_len;
+            if (line_len > 0 && script[line_len - 1] == '\r') {
+                line_len--;
+            }
+            batch_lines++;
+            if (batch_quiet && line_len == 4 && memcmp(script, "quit", 4) == 0) {
+                at_eof = 1;
+                script_len = 0;
+                continue;
+            }
+            if (strspn(script, " \t") < line_len) {  // Blank lines are skipped
+                int n = snprintf(frame + PROTO_HDR_SIZE, sizeof(frame) - PROTO_HDR_SIZE, "%lu %.*s",
+                                 batch_lines, (int)line_len, script);
+                if (batch_quiet && reads_stdin(frame + PROTO_HDR_SIZE + n - line_len)) {
+                    stream = 1;
+                }
+                proto_encode_header((unsigned char *)frame, stream ? MSG_PIPED : MSG_SCRIPT, current, n);
+                frame_len = PROTO_HDR_SIZE + n;
+                frame_off = 0;
+                batch_sent++;
+            }
+            memmove(script, script + used, script_len - used);
+            script_len -= used;
+            continue;
+        }
+
+        // Frame the data read so far, or the end of it
+        if (stream == 1 && frame_off == frame_len && (script_len > 0 || at_eof)) {
+            memcpy(frame + PROTO_HDR_SIZE, script, script_len);
+            proto_encode_header((unsigned char *)frame, script_len > 0 ? MSG_DATA : MSG_EOF, current, script_len);
+            frame_len = PROTO_HDR_SIZE + script_len;
+            frame_off = 0;
+            stream = (script_len > 0) ? 1 : 2;
+            script_len = 0;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = sockfd;
+        fds[0].events = POLLIN | (frame_off < frame_len ? POLLOUT : 0);
+        fds[1].fd = batch_fd;
+        fds[1].events = (at_eof || nl != NULL || script_len == sizeof(script)) ? 0 : POLLIN;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
 
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = proto_reader_fill(&reader, sockfd);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || print_frames() < 0) {
+                return -1;
+            }
+            fflush(stdout);
+            if (channels[current] == NULL) {
+                return -1;
+            }
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(batch_fd, script + script_len, sizeof(script) - script_len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                at_eof = 1;
+            } else {
+                script_len += n;
+            }
+        }
+
+        if (frame_off < frame_len) {
+            ssize_t n = send(sockfd, frame + frame_off, frame_len - frame_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+            if (n > 0) {
+                frame_off += n;
+            }
+        }
+    }
+    return 0;
+}
+
+// Put the terminal in raw mode: every keystroke goes to the remote shell,
+// which does the echoing, line editing and Ctrl-C/Ctrl-Z handling
+void term_raw() {
+    struct termios tio;
+
+    if (!tio_saved) {
+        return;
+    }
+    tio = saved_tio;
+    tio.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    tio.c_iflag &= ~(IXON | ICRNL | INLCR | IGNCR);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &tio);
+}
+
+void term_restore() {
+    if (tio_saved) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_tio);
+    }
+}
+
+// Ctrl-] was typed: read one client command with the terminal back in its
+// normal mode. Returns -1 if the connection turned out to be gone.
+int local_command() {
+    char command[BUFFER_SIZE];
+    int rc = 0;
+
+    term_restore();
+    printf("\nyash> ");
+    fflush(stdout);
+    if (fgets(command, sizeof(command), stdin) == NULL) {
+        handle_quit(0);
+    }
+    command[strcspn(command, "\n")] = '\0';
+
+    if (strcmp(command, "quit") == 0) {
+        handle_quit(0);
+    } else if (strcmp(command, "stats") == 0) {
+        // Answered by yashd itself, not the shell
+        rc = request_stats();
+    } else if (strncmp(command, "chan", 4) == 0 && (command[4] == '\0' || command[4] == ' ')) {
+        // So are the commands that manage the shells on the connection
+        channel_command(command + 4);
+    } else if (command[0] != '\0') {
+        printf("Commands: quit, stats, chan [open | close | <id>]\n");
+    }
+    fflush(stdout);
+    term_raw();
+    return rc;
+}
+
+// Main client loop. Keystrokes go to the current channel's shell as they
+// are typed and output from every channel is shown the moment it arrives;
+// neither waits for the other.
+void client_loop() {
+    static char keys[PROTO_HDR_SIZE + STREAM_CHUNK];
+    size_t keys_len = 0, keys_off = 0;
+
+    term_raw();
+    while (1) {
+        int lost = 0;
+
+        // The current shell went away: carry on with another one
+        if (channels[current] == NULL) {
+            current = channel_find(1);
+            if (current < 0) {
+                term_restore();
+                printf("Session ended.\n");
+                break;
+            }
+            printf("[switched to channel %d]\n", current);
+            fflush(stdout);
+            keys_len = keys_off = 0;  // Typed for the shell that is gone
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = sockfd;
+        fds[0].events = POLLIN | (keys_off < keys_len ? POLLOUT : 0);
+        fds[1].fd = STDIN_FILENO;
+        fds[1].events = (keys_off < keys_len) ? 0 : POLLIN;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = proto_reader_fill(&reader, sockfd);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            lost = (n <= 0 || print_frames() < 0);
+            fflush(stdout);
+        }
+
+        if (!lost && (fds[1].revents & (POLLIN | POLLHUP))) {
+            ssize_t n = read(STDIN_FILENO, keys + PROTO_HDR_SIZE, STREAM_CHUNK);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                handle_quit(0);  // The terminal went away
+            }
+            char *esc = memchr(keys + PROTO_HDR_SIZE, ESCAPE_CHAR, n);
+            if (esc != NULL) {
+                n = esc - (keys + PROTO_HDR_SIZE);  // Anything typed after it is dropped
+            }
+            if (n > 0) {
+                proto_encode_header((unsigned char *)keys, MSG_KEYS, current, n);
+                keys_len = PROTO_HDR_SIZE + n;
+                keys_off = 0;
+            }
+            if (esc != NULL) {
+                if (n > 0) {
+                    proto_send(sockfd, MSG_KEYS, current, keys + PROTO_HDR_SIZE, n);
+                    keys_len = keys_off = 0;
+                }
+                lost = (local_command() < 0);
+            }
+        }
+
+        if (!lost && keys_off < keys_len) {
+            ssize_t n = send(sockfd, keys + keys_off, keys_len - keys_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                lost = 1;
+            }
+            if (n > 0) {
+                keys_off += n;
+            }
+        }
+
+        // The connection dropped: pick the sessions up again where we left them
+        if (lost) {
+            term_restore();
+            if (reattach() < 0) {
+                printf("Server disconnected or error occurred.\n");
+                break;
+            }
+            keys_len = keys_off = 0;
+            term_raw();
+        }
     }
 }
 
 
 int main(int argc, char *argv[]) {
+    int opt;
+
+    const char *script = NULL;
+
+    while ((opt = getopt(argc, argv, "zf:")) != -1) {
+        if (opt == 'z') {
+            want_zlib = 1;
+        } else if (opt == 'f') {
+            script = optarg;
+        } else {
+            argc = 0;  // Fall through to the usage message
+        }
+    }
+
     // Check if the IP address is provided
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <IP_Address_of_Server>\n", argv[0]);
+    if (argc != optind + 1) {
+        fprintf(stderr, "Usage: %s [-z] [-f script] <IP_Address_of_Server | socket_path>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    // A script file ("-" for stdin) runs as a batch. So do commands piped in
+    // without -f, where stdin can also carry data for them.
+    if (script != NULL && strcmp(script, "-") != 0) {
+        batch_fd = open(script, O_RDONLY);
+        if (batch_fd < 0) {
+            perror(script);
+            exit(EXIT_FAILURE);
+        }
+    } else if (script != NULL) {
+        batch_fd = STDIN_FILENO;
+    }
+    batch_quiet = (batch_fd < 0 && !isatty(STDIN_FILENO));
+    if (batch_quiet) {
+        batch_fd = STDIN_FILENO;
+    }
+
+    // Keystrokes are taken with read() and local commands with fgets(),
+    // so stdio must not buffer stdin ahead of us
+    if (batch_fd < 0) {
+        setvbuf(stdin, NULL, _IONBF, 0);
+        if (tcgetattr(STDIN_FILENO, &saved_tio) == 0) {
+            tio_saved = 1;
+            atexit(term_restore);
+        }
+    }
+
     // Set up signal handling for Ctrl-C (SIGINT) and Ctrl-Z (SIGTSTP)
     signal(SIGINT, handle_sigint);    // Handle Ctrl-C (SIGINT)
     signal(SIGTSTP, handle_sigtstp);  // Handle Ctrl-Z (SIGTSTP)
 
     // Connect to the server
-    server_connect(argv[1]);
+    server_ip = argv[optind];
+    server_connect(server_ip);
+    if (proto_reader_init(&reader) < 0 || channel_add(0) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Offer compression; the server answers with MSG_HELLO and switches to
+    // MSG_ZOUT frames, or keeps sending MSG_OUT if it declines
+    if (want_zlib) {
+        proto_send(sockfd, MSG_HELLO, 0, "zlib", 4);
+    }
+
+    // Run the script or the piped commands, then end the session: exit
+    // status 1 if any line failed, 2 if the run was cut short
+    if (batch_fd >= 0) {
+        int rc = batch_run();
+        if (rc < 0) {
+            fprintf(stderr, "Server disconnected after %lu of %lu lines.\n", batch_done, batch_sent);
+        }
+        proto_send(sockfd, MSG_CTL, current, "q", 1);
+        close(sockfd);
+        return rc < 0 ? 2 : (batch_failed > 0);
+    }
 
     // Start the client loop
     client_loop();
@@ -0,0 +1,221 @@
+// logger.c: Lock-free MPSC ring and batching writer thread for the audit log
+
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <syslog.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+// One queued record. seq implements the bounded MPMC queue protocol
+// (D. Vyukov): a slot is free for position p when seq == p and holds a
+// record for the consumer when seq == p + 1.
+typedef struct {
+    atomic_size_t seq;
+    time_t when;
+    int port;
+    char ip[INET_ADDRSTRLEN];
+    size_t len;
+    char text[LOG_TEXT_MAX];
+} log_slot_t;
+
+static log_slot_t ring[LOG_RING_SLOTS];
+static atomic_size_t enqueue_pos;
+static atomic_size_t dequeue_pos;
+static atomic_ulong dropped;
+static atomic_int running;
+
+static int log_fd = -1;
+static pthread_t log_thread;
+static sem_t wakeup;
+
+// Cached strftime() output, refreshed only when the second changes
+static time_t cached_when = (time_t)-1;
+static char cached_time[32];
+
+static const char *format_time(time_t when) {
+    if (when != cached_when) {
+        struct tm tm;
+        localtime_r(&when, &tm);
+        strftime(cached_time, sizeof(cached_time), "%b %d %H:%M:%S", &tm);  // Format time like syslog
+        cached_when = when;
+    }
+    return cached_time;
+}
+
+// Enqueue one record. Never blocks: returns -1 and counts a drop when full.
+int logger_submit(const char *ip, int port, const char *text, size_t len) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    log_slot_t *slot;
+
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->when = time(NULL);
+    slot->port = port;
+    strncpy(slot->ip, ip, sizeof(slot->ip) - 1);
+    slot->ip[sizeof(slot->ip) - 1] = '\0';
+    slot->len = (len < LOG_TEXT_MAX) ? len : LOG_TEXT_MAX;
+    memcpy(slot->text, text, slot->len);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // Wake the writer early once a full batch is waiting
+    if (pos + 1 - atomic_load_explicit(&dequeue_pos, memory_order_relaxed) == LOG_BATCH) {
+        sem_post(&wakeup);
+    }
+    return 0;
+}
+
+unsigned long logger_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+static void write_all(struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(log_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to write log file");
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Write every ready record, LOG_BATCH at a time. Records are written straight
+// out of their ring slots, which are only handed back after the writev().
+static void drain(void) {
+    static struct iovec iov[LOG_BATCH * 3 + 1];
+    static char prefix[LOG_BATCH][96];  // "<time> yashd[ip:port]: " per record
+    static char drop_note[96];
+    static unsigned long reported;
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+        int count = 0, iovcnt = 0;
+
+        while (count < LOG_BATCH) {
+            log_slot_t *slot = &ring[(head + count) & (LOG_RING_SLOTS - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + count + 1) {
+                break;
+            }
+            int len = snprintf(prefix[count], sizeof(prefix[count]), "%s yashd[%s:%d]: ",
+                               format_time(slot->when), slot->ip, slot->port);
+            iov[iovcnt].iov_base = prefix[count];
+            iov[iovcnt++].iov_len = (len < (int)sizeof(prefix[count])) ? len : sizeof(prefix[count]) - 1;
+            iov[iovcnt].iov_base = slot->text;
+            iov[iovcnt++].iov_len = slot->len;
+            iov[iovcnt].iov_base = "\n";
+            iov[iovcnt++].iov_len = 1;
+            count++;
+        }
+
+        unsigned long lost = logger_dropped();
+        if (lost != reported) {
+            snprintf(drop_note, sizeof(drop_note), "%s yashd: %lu log records dropped\n",
+                     format_time(time(NULL)), lost - reported);
+            iov[iovcnt].iov_base = drop_note;
+            iov[iovcnt++].iov_len = strlen(drop_note);
+            reported = lost;
+        }
+
+        if (iovcnt > 0) {
+            write_all(iov, iovcnt);
+        }
+
+        // Hand the slots back to producers
+        for (int i = 0; i < count; i++) {
+            log_slot_t *slot = &ring[(head + i) & (LOG_RING_SLOTS - 1)];
+            atomic_store_explicit(&slot->seq, head + i + LOG_RING_SLOTS, memory_order_release);
+        }
+        atomic_store_explicit(&dequeue_pos, head + count, memory_order_relaxed);
+
+        if (count < LOG_BATCH) {
+            return;
+        }
+    }
+}
+
+static void *logger_main(void *arg) {
+    struct timespec deadline;
+
+    while (atomic_load(&running)) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&wakeup, &deadline);
+        drain();
+    }
+    drain();
+    return NULL;
+}
+
+// Open the log file and start the writer thread
+int logger_start(const char *path) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (log_fd < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+    sem_init(&wakeup, 0, 0);
+    atomic_store(&running, 1);
+
+    if (pthread_create(&log_thread, NULL, logger_main, NULL) != 0) {
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Flush what is queued and stop the writer thread
+void logger_stop(void) {
+    if (log_fd < 0) {
+        return;
+    }
+    atomic_store(&running, 0);
+    sem_post(&wakeup);
+    pthread_join(log_thread, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,21 @@
+// logger.h: Asynchronous command audit log for yashd
+//
+// Sessions enqueue records into a lock-free multi-producer ring; one logger
+// thread formats them and appends them to the log file in batches.
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+
+#define LOG_RING_SLOTS 4096   // Must be a power of two
+#define LOG_TEXT_MAX 256      // Longer commands are truncated in the log
+#define LOG_BATCH 128         // Records per writev()
+#define LOG_FLUSH_MS 100      // Longest a record waits before being written
+
+int logger_start(const char *path);
+void logger_stop(void);
+int logger_submit(const char *ip, int port, const char *text, size_t len);
+unsigned long logger_dropped(void);
+
+#endif
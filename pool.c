@@ -0,0 +1,128 @@
+// pool.c: Warm session pool and its refill thread
+
+#include "pool.h"
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+// One ready shell waiting for a connection
+typedef struct {
+    int master_fd;
+    int ctl_fd;
+    pid_t shell_pid;
+} pool_slot_t;
+
+static pool_slot_t slots[POOL_MAX_SIZE];
+static int slot_count;
+static int target;
+static int running;
+static pool_spawn_fn spawn_shell;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t need_refill = PTHREAD_COND_INITIALIZER;
+static pthread_t refill_thread;
+
+static atomic_ulong hits;
+static atomic_ulong misses;
+
+// Refill thread: start shells whenever the pool is below its target size
+static void *refill(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (running) {
+        if (slot_count >= target) {
+            pthread_cond_wait(&need_refill, &lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+
+        int master_fd, ctl_fd;
+        pid_t pid = spawn_shell(&master_fd, &ctl_fd);
+
+        pthread_mutex_lock(&lock);
+        if (pid < 0) {
+            // Out of ptys or processes: back off instead of spinning
+            pthread_mutex_unlock(&lock);
+            sleep(1);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+        slots[slot_count].master_fd = master_fd;
+        slots[slot_count].ctl_fd = ctl_fd;
+        slots[slot_count].shell_pid = pid;
+        slot_count++;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int pool_start(int size, pool_spawn_fn spawn) {
+    if (size <= 0) {
+        return 0;  // Pool disabled: every session is a miss
+    }
+    target = size < POOL_MAX_SIZE ? size : POOL_MAX_SIZE;
+    spawn_shell = spawn;
+    running = 1;
+    if (pthread_create(&refill_thread, NULL, refill, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Hand out a warm shell. Returns 0 on a hit, -1 when the caller must start
+// its own shell.
+int pool_take(int *master_fd, int *ctl_fd, pid_t *shell_pid) {
+    pthread_mutex_lock(&lock);
+    while (slot_count > 0) {
+        pool_slot_t slot = slots[--slot_count];
+        pthread_cond_signal(&need_refill);
+
+        // Skip shells that died while they were waiting
+        if (kill(slot.shell_pid, 0) < 0 && errno == ESRCH) {
+            close(slot.master_fd);
+            close(slot.ctl_fd);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+        *master_fd = slot.master_fd;
+        *ctl_fd = slot.ctl_fd;
+        *shell_pid = slot.shell_pid;
+        atomic_fetch_add(&hits, 1);
+        return 0;
+    }
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add(&misses, 1);
+    return -1;
+}
+
+void pool_stop(void) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_signal(&need_refill);
+    pthread_mutex_unlock(&lock);
+    pthread_join(refill_thread, NULL);
+
+    for (int i = 0; i < slot_count; i++) {
+        close(slots[i].master_fd);
+        close(slots[i].ctl_fd);
+        kill(slots[i].shell_pid, SIGHUP);
+    }
+    slot_count = 0;
+    syslog(LOG_INFO, "Session pool: %lu hits, %lu misses", pool_hits(), pool_misses());
+}
+
+unsigned long pool_hits(void) {
+    return atomic_load(&hits);
+}
+
+unsigned long pool_misses(void) {
+    return atomic_load(&misses);
+}
@@ -0,0 +1,27 @@
+// pool.h: Pre-forked pool of warm pty + shell sessions for yashd
+//
+// A refill thread keeps up to the configured number of shells started and
+// sitting at their first prompt, so an accepted connection can be handed a
+// ready pty instead of paying for forkpty() and shell startup.
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+
+#define POOL_DEFAULT_SIZE 8
+#define POOL_MAX_SIZE 256
+
+// Starts one shell on a new pty, with a control socket to it; returns its
+// pid or -1. It runs on the
+// refill thread, so it must not fork there: a child of a threaded process
+// can inherit a lock held by another thread.
+typedef pid_t (*pool_spawn_fn)(int *master_fd, int *ctl_fd);
+
+int pool_start(int size, pool_spawn_fn spawn);
+void pool_stop(void);
+int pool_take(int *master_fd, int *ctl_fd, pid_t *shell_pid);
+unsigned long pool_hits(void);
+unsigned long pool_misses(void);
+
+#endif
@@ -0,0 +1,161 @@
+// proto.c: Frame encoding and incremental decoding for the yash/yashd protocol
+
+#include "proto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int proto_reader_init(frame_reader_t *fr) {
+    fr->cap = PROTO_HDR_SIZE + PROTO_MAX_PAYLOAD;
+    fr->buf = malloc(fr->cap);
+    fr->start = fr->end = 0;
+    return (fr->buf == NULL) ? -1 : 0;
+}
+
+void proto_reader_free(frame_reader_t *fr) {
+    free(fr->buf);
+    fr->buf = NULL;
+}
+
+// Read as much as fits from fd. Returns the recv() result:
+// >0 bytes added, 0 on EOF, -1 with errno set (EAGAIN when nothing is pending).
+ssize_t proto_reader_fill(frame_reader_t *fr, int fd) {
+    // Slide the unconsumed tail to the front to make room
+    if (fr->start > 0) {
+        memmove(fr->buf, fr->buf + fr->start, fr->end - fr->start);
+        fr->end -= fr->start;
+        fr->start = 0;
+    }
+    if (fr->end == fr->cap) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t n = recv(fd, fr->buf + fr->end, fr->cap - fr->end, 0);
+    if (n > 0) {
+        fr->end += n;
+    }
+    return n;
+}
+
+// Pop the next complete frame.
+// Returns 1 with *frame filled, 0 if more bytes are needed, -1 on a malformed frame.
+int proto_next(frame_reader_t *fr, frame_t *frame) {
+    size_t avail = fr->end - fr->start;
+    if (avail < PROTO_HDR_SIZE) {
+        return 0;
+    }
+
+    const unsigned char *hdr = (const unsigned char *)fr->buf + fr->start;
+    uint16_t channel;
+    uint32_t len;
+    memcpy(&channel, hdr + 1, sizeof(channel));
+    memcpy(&len, hdr + 3, sizeof(len));
+    len = ntohl(len);
+    if (len > PROTO_MAX_PAYLOAD) {
+        return -1;
+    }
+    if (avail < PROTO_HDR_SIZE + len) {
+        return 0;
+    }
+
+    frame->type = hdr[0];
+    frame->channel = ntohs(channel);
+    frame->len = len;
+    frame->payload = fr->buf + fr->start + PROTO_HDR_SIZE;
+    fr->start += PROTO_HDR_SIZE + len;
+    return 1;
+}
+
+void proto_encode_header(unsigned char *hdr, unsigned char type, uint16_t channel, uint32_t len) {
+    uint16_t nchannel = htons(channel);
+    uint32_t nlen = htonl(len);
+    hdr[0] = type;
+    memcpy(hdr + 1, &nchannel, sizeof(nchannel));
+    memcpy(hdr + 3, &nlen, sizeof(nlen));
+}
+
+// Send one whole frame on a blocking socket. Header and payload go out in
+// a single sendmsg() so frames sent from signal handlers do not interleave.
+int proto_send(int fd, unsigned char type, uint16_t channel, const void *payload, size_t len) {
+    unsigned char hdr[PROTO_HDR_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = PROTO_HDR_SIZE + len;
+    size_t sent = 0;
+
+    if (len > PROTO_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    proto_encode_header(hdr, type, channel, (uint32_t)len);
+
+    while (sent < total) {
+        memset(&msg, 0, sizeof(msg));
+        int n = 0;
+        if (sent < PROTO_HDR_SIZE) {
+            iov[n].iov_base = hdr + sent;
+            iov[n++].iov_len = PROTO_HDR_SIZE - sent;
+            iov[n].iov_base = (void *)payload;
+            iov[n++].iov_len = len;
+        } else {
+            iov[n].iov_base = (char *)payload + (sent - PROTO_HDR_SIZE);
+            iov[n++].iov_len = total - sent;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += w;
+    }
+    return 0;
+}
+
+int proto_inflate_init(proto_inflater_t *in) {
+    memset(&in->zs, 0, sizeof(in->zs));
+    in->active = (inflateInit(&in->zs) == Z_OK);
+    return in->active ? 0 : -1;
+}
+
+void proto_inflate_end(proto_inflater_t *in) {
+    if (in->active) {
+        inflateEnd(&in->zs);
+        in->active = 0;
+    }
+}
+
+// Decompress one MSG_ZOUT payload, handing each chunk of output to emit.
+// Returns -1 if the stream is corrupt.
+int proto_inflate(proto_inflater_t *in, const frame_t *frame, proto_emit_fn emit, void *arg) {
+    if (!in->active) {
+        return -1;
+    }
+    in->zs.next_in = (Bytef *)frame->payload;
+    in->zs.avail_in = frame->len;
+
+    do {
+        in->zs.next_out = (Bytef *)in->out;
+        in->zs.avail_out = sizeof(in->out);
+        int rc = inflate(&in->zs, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            return -1;
+        }
+        size_t produced = sizeof(in->out) - in->zs.avail_out;
+        if (produced > 0) {
+            emit(in->out, produced, arg);
+        }
+        if (rc == Z_BUF_ERROR) {
+            break;  // No progress possible until the next frame
+        }
+    } while (in->zs.avail_in > 0 || in->zs.avail_out == 0);
+    return 0;
+}
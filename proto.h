@@ -0,0 +1,93 @@
+// proto.h: Framed wire protocol shared by yash (client.c) and yashd (server.c)
+//
+// Every message on the socket is a frame:
+//   [1 byte type][2 byte channel][4 byte payload length][payload]
+// with multi-byte fields in network order. The channel picks one of the
+// shells multiplexed over the connection; channel 0 opens with it.
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define PROTO_HDR_SIZE 7
+#define PROTO_MAX_CHANNELS 256
+#define PROTO_MAX_PAYLOAD 65536
+#define PROTO_INFLATE_CHUNK 65536
+
+// Frame types
+#define MSG_CMD 'C'   // client -> server: one command line, no trailing newline
+#define MSG_CTL 'K'   // client -> server: payload "c" (Ctrl-C), "z" (Ctrl-Z), "s" (stats request)
+                      // or "q" (end the session instead of detaching)
+#define MSG_DATA 'D'  // client -> server: raw stdin bytes for the last MSG_PIPED line
+#define MSG_EOF 'E'   // client -> server: end of that stdin stream (empty payload)
+#define MSG_OUT 'O'   // server -> client: shell output
+#define MSG_STATS 'S' // server -> client: counters in text exposition format, answers CTL "s"
+#define MSG_HELLO 'H' // client -> server: compression modes offered ("zlib");
+                      // server -> client: the mode chosen, empty for none
+#define MSG_ZOUT 'Z'  // server -> client: shell output, part of one zlib stream per session
+#define MSG_SESSION 'T'  // server -> client: token that reattaches to this session
+#define MSG_ATTACH 'A'   // client -> server: "<token> <output bytes received>", sent first;
+                         // server -> client: "<replay offset> <end offset>", empty if unknown
+#define MSG_OPEN 'N'     // client -> server: start a shell on an unused channel
+#define MSG_CLOSE 'X'    // client -> server: end the channel's shell;
+                         // server -> client: the channel is gone
+#define MSG_SCRIPT 'B'   // client -> server: "<seq> <command line>", one line of a script.
+                         // Runs after the lines before it, with stdin on /dev/null
+#define MSG_PIPED 'P'    // client -> server: "<seq> <command line>", marked like MSG_SCRIPT,
+                         // with stdin on a pipe fed the MSG_DATA frames that follow and
+                         // closed at MSG_EOF
+#define MSG_KEYS 'I'     // client -> server: keystrokes exactly as typed, for a raw terminal
+#define MSG_QUEUE 'W'    // server -> client: "<position>" while the connection waits for
+                         // a free session slot; the shell's output follows once admitted
+
+// Marks the shell puts in a channel's output around each MSG_SCRIPT or MSG_PIPED line:
+//   PROTO_MARK "b<seq>" PROTO_MARK_END   before its output
+//   PROTO_MARK "e<seq>;<exit status>" PROTO_MARK_END   after it
+// Output outside a pair is prompts and line-editor noise.
+#define PROTO_MARK "\033]ysh;"
+#define PROTO_MARK_END "\007"
+#define PROTO_MARK_MAX 64  // Longest whole mark
+
+// A decoded frame; payload points into the reader and is valid until the next fill
+typedef struct {
+    unsigned char type;
+    uint16_t channel;
+    uint32_t len;
+    const char *payload;
+} frame_t;
+
+// Reassembles frames from a byte stream: handles partial frames and
+// several frames arriving in one read
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t start;  // First byte not yet consumed
+    size_t end;    // One past the last byte received
+} frame_reader_t;
+
+int proto_reader_init(frame_reader_t *fr);
+void proto_reader_free(frame_reader_t *fr);
+ssize_t proto_reader_fill(frame_reader_t *fr, int fd);
+int proto_next(frame_reader_t *fr, frame_t *frame);
+
+void proto_encode_header(unsigned char *hdr, unsigned char type, uint16_t channel, uint32_t len);
+int proto_send(int fd, unsigned char type, uint16_t channel, const void *payload, size_t len);
+
+// Client side of a negotiated zlib output stream
+typedef struct {
+    z_stream zs;
+    int active;
+    char out[PROTO_INFLATE_CHUNK];
+} proto_inflater_t;
+
+typedef void (*proto_emit_fn)(const char *data, size_t len, void *arg);
+
+int proto_inflate_init(proto_inflater_t *in);
+void proto_inflate_end(proto_inflater_t *in);
+int proto_inflate(proto_inflater_t *in, const frame_t *frame, proto_emit_fn emit, void *arg);
+
+#endif
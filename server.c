@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -5,44 +6,223 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <sys/resource.h>
 #include <syslog.h>
+#include <pthread.h>
+#ifdef __APPLE__
 #include <util.h>
+#else
+#include <pty.h>
+#endif
 #include <utmp.h>
 #include <termios.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <zlib.h>
 
 #include "ysh.h"
+#include "proto.h"
+#include "logger.h"
+#include "pool.h"
+#include "acceptor.h"
+#include "stats.h"
+#include "uring.h"
+
 
 #define PORT 3822
-#define MAX_CONNECTIONS 10
-#define BUFFER_SIZE 1024
-#define MAX_ARGS 10
+#define STATS_SOCKET_PATH "/tmp/yashd-stats.sock"  // Local admin socket that dumps counters
+#define LOCAL_SOCKET_PATH "/tmp/yashd.sock"        // Unix socket that local clients connect to
+#define MAX_SESSIONS 4096     // Default session cap
+#define MAX_LISTENERS 2       // The TCP port and the local socket
+#define ADMIT_QUEUE_DEFAULT 256  // Connections that may wait for a session
+#define MAX_EVENTS 64
+#define OUTPUT_RING_SIZE (256 * 1024)  // Pty output per session awaiting the socket; power of two
+#define ZLIB_LEVEL 6                   // Output compression level when a client asks for zlib
+#define INPUT_BUFFER_SIZE (4 * (PROTO_HDR_SIZE + PROTO_MAX_PAYLOAD))
+// Most pty input one frame can queue: a script or piped line gets its
+// prefix and a newline around its payload
+#define FRAME_INPUT_MAX(len) ((len) + sizeof(SCRIPT_PREFIX))
+// ... and n bytes of frames: at most one more than their wire size each
+#define READER_INPUT_MAX(n) ((n) + (n) / PROTO_HDR_SIZE)
+#define DETACH_GRACE_SEC 600  // Default time a detached shell waits for its client
+#define DETACH_POLL_MS 1000   // How often detached sessions are checked for expiry
+#define QUEUE_POLL_MS 1000    // How often waiting connections are checked for hangups
+#define TOKEN_BYTES 16        // Random bytes in a session token (hex encoded)
+#define SCRIPT_PREFIX "%batch "  // How a MSG_SCRIPT line reaches the session's shell
+#define PIPED_PREFIX "%piped "   // ... and a MSG_PIPED one; the same length as SCRIPT_PREFIX
+#define SESSION_CTL_FD 3      // Where a session shell finds its control socket
+#define TYPED_MAX 1024        // Longest typed line kept for the audit log
+#define CORK_DEFAULT_BYTES (32 * 1024)  // Output backlog that counts as bulk; 0 never corks
+#define CORK_DEFAULT_MS 5     // How long corked output may wait for the segment to fill
+
+// Results of I/O handlers besides 0 (keep going)
+#define SESSION_CLOSE -1      // End the session (or every session on a connection)
+#define SESSION_DETACH -2     // The client went away; its shells may outlive it
+
+// Command-line settings
+typedef struct {
+    int pool_size;            // Warm shells kept ready
+    const char *stats_path;   // Admin socket for the counters
+    const char *local_path;   // Unix socket for local clients, "" for none
+    int grace_sec;            // How long a detached session survives
+    int use_uring;            // Wait and transfer on io_uring instead of epoll when the kernel allows
+    int cork_bytes;           // Output backlog at which a connection is corked
+    int cork_ms;              // Flush timer for a corked connection
+    int acceptors;            // Threads accepting on the TCP port; 0 leaves it to the reactor
+    int max_sessions;
+    int queue_len;            // Connections waiting past the cap; more are refused
+} server_config_t;
+
+// A connection accepted while every session slot was taken
+typedef struct {
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+} waiting_t;
 
-pthread_t client_threads[MAX_CONNECTIONS];  // Array to hold thread IDs
-int thread_count = 0;  // To track the current number of active threads
+// What a registered fd is, so the reactor knows how to dispatch its events
+typedef enum { EV_LISTEN, EV_ACCEPTED, EV_SOCKET, EV_PTY, EV_PIPE, EV_ADMIN } ev_kind_t;
 
-pthread_mutex_t thread_count_lock = PTHREAD_MUTEX_INITIALIZER;
+typedef struct session session_t;
+typedef struct conn conn_t;
 
+// Tag stored in epoll_event.data for every registered fd
 typedef struct {
-    int client_socket;
-    char client_ip[INET_ADDRSTRLEN];
+    ev_kind_t kind;
+    conn_t *conn;        // Set for EV_SOCKET
+    session_t *session;  // Set for EV_PTY and EV_PIPE
+    int slot;            // io_uring watch, when that backend is in use
+} ev_tag_t;
+
+// Per-session state: one pty running a shell, carried on one channel of a
+// client connection
+struct session {
+    conn_t *conn;               // NULL while detached
+    uint16_t channel;           // Channel id on that connection
+    char token[2 * TOKEN_BYTES + 1];  // Lets a new connection attach to this session
+    int detached;
+    long long detach_until;     // now_ms() after which a detached session is closed
+    int master_fd;
+    int ctl_fd;                 // Control socket; stdin pipes go to the shell over it
+    pid_t shell_pid;
+    char client_ip[INET_ADDRSTRLEN];  // Last client, for logs and stats labels
     int client_port;
-} client_t;
+
+    char *in_buf;               // Client input waiting for room in the pty
+    size_t in_len;
+    size_t in_off;
+    char typed[TYPED_MAX];      // Line being typed through MSG_KEYS, for the audit log
+    size_t typed_len;
+    int typed_esc;              // Inside an escape sequence: 1 after ESC, 2 in CSI/SS3
+    int data_fd;                // Write end of the piped command's stdin, -1 if none
+    char *data_buf;             // Stdin data waiting for room in that pipe
+    size_t data_len;
+    size_t data_off;
+    int data_eof;               // The stream ended: close the pipe once data_buf drains
+    char *out_ring;             // Pty output; doubles as scrollback once sent
+    int ring_buf;               // out_ring's registered buffer in uring_io, -1 if none
+    size_t out_head;            // Total bytes ever written to / sent from the ring
+    size_t out_tail;            // Offsets in this byte stream are what clients resume from
+    unsigned char out_hdr[PROTO_HDR_SIZE];  // Header of the MSG_OUT frame being sent
+    size_t hdr_off;             // == PROTO_HDR_SIZE once the header is out
+    size_t frame_left;          // Payload bytes of that frame still to send
+    z_stream *zout;             // Output compressor, NULL unless negotiated
+    char *zbuf;                 // One framed MSG_ZOUT being sent
+    size_t zlen;
+    size_t zoff;
+    int zflush_pending;         // Last sync flush ran out of room and must be repeated
+    session_stats_t stats;
+    int read_queued;            // The pty was read with the batch's transfers
+    int read_rc;                // SESSION_CLOSE if that found the shell gone
+    ssize_t read_res;           // What the last of those reads returned
+
+    ev_tag_t pty_ev;
+    uint32_t pty_events;        // Interest set currently registered with epoll
+    ev_tag_t data_ev;
+    uint32_t data_events;
+    session_t *prev;            // Every session, attached or not
+    session_t *next;
+    session_t *chan_next;       // Other sessions on the same connection
+};
+
+// Per-connection state: one client socket multiplexing any number of
+// sessions, each on its own channel
+struct conn {
+    int client_socket;
+    char client_ip[INET_ADDRSTRLEN];  // "local" on the Unix socket,
+    int client_port;                  // where the port is the client's pid
+    int local;                  // Came in on the Unix socket, not TCP
+    frame_reader_t reader;      // Reassembles client frames
+    session_t *channel[PROTO_MAX_CHANNELS];  // Sessions by channel id
+    session_t *channels;        // The same sessions as a list
+    session_t *sending;         // Session whose output frame is partly written
+    session_t *last_sent;       // Where the round robin over channels resumes
+    int want_zlib;              // Compress output of every channel
+    int quit;                   // Client asked to end its sessions
+    int stalled;                // A frame waits in the reader for room in its shell's input
+    char *reply;                // Framed answers to control requests, sent between frames
+    size_t reply_len;
+    size_t reply_off;
+    int corked;                 // TCP_CORK is set: bulk output is being coalesced
+    long long uncork_at;        // now_ms() at which the cork comes off
+    int flush_queued;           // On the reactor's flushing list
+    conn_t *flush_next;
+    int write_queued;           // The sending frame went out with the batch's transfers
+    ssize_t write_res;          // and this is what the write returned
+
+    ev_tag_t sock_ev;
+    uint32_t sock_events;       // Interest set currently registered with epoll
+};
+
+// Single-threaded event loop owning the listening sockets and every session
+typedef struct {
+    int epoll_fd;
+    uring_t *uring;       // Replaces epoll_fd for waiting when set
+    uring_t *uring_io;    // Batches pty reads and socket writes when set
+    conn_t *flushing;     // Connections to flush with the batch's writes
+    int batch_writes;     // conn_flush() queues MSG_OUT frames on uring_io
+    int listen_fd[MAX_LISTENERS];  // The TCP port unless accept threads serve it,
+    ev_tag_t listen_ev[MAX_LISTENERS];  // then the Unix socket if there is one
+    int listen_count;
+    int accept_fd;        // Eventfd of the accept threads' queue, -1 without them
+    ev_tag_t accept_ev;
+    int admin_fd;         // Stats socket, -1 if it could not be created
+    ev_tag_t admin_ev;
+    session_t *sessions;  // List of active sessions
+    int session_count;
+    int max_sessions;
+    waiting_t *waiting;   // Admission queue, a ring of queue_max entries
+    int queue_head;
+    int queue_count;
+    int queue_max;
+    long long queue_check_at;  // When waiting connections are next checked for hangups
+    int detached_count;   // Sessions waiting for their client to come back
+    long long grace_ms;   // How long they wait; 0 closes sessions with their connection
+    size_t cork_bytes;    // Output backlog that switches a connection to corked sends
+    int cork_ms;
+    int corked_count;     // Connections with TCP_CORK set
+    struct epoll_event *batch;  // Events of the current epoll_wait() not yet handled
+    int batch_left;
+} reactor_t;
 
 
 // Daemonize the process
 void create_daemon() {
     pid_t pid;
-    static FILE *log; /* for the log */
 
     pid = fork();
     if (pid < 0) {
@@ -96,385 +276,2360 @@ void create_daemon() {
 }
 
 
-void *handle_client(void *arg) {
-    client_t *client_info = (client_t *)arg;  // Cast the argument to client_t struct
-    int client_socket = client_info->client_socket;
-    char client_ip[INET_ADDRSTRLEN];
-    strcpy(client_ip, client_info->client_ip);
-    int client_port = client_info->client_port;
+// Monotonic clock in milliseconds for reactor timers
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    syslog(LOG_INFO, "Handling client: %s:%d", client_ip, client_port);
-    free(client_info);  // Free the dynamically allocated client struct
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    int master_fd, slave_fd;
-    pid_t pid;
+// Put a file descriptor into non-blocking mode
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    // Time buffer for logging
-    char time_str[64];
-    time_t now;
-    struct tm *timeinfo;
+// Drop every descriptor the shell child inherited from the reactor, all
+// but its control socket
+static void close_inherited_fds(void) {
+#ifdef __linux__
+    if (close_range(SESSION_CTL_FD + 1, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    for (int k = getdtablesize() - 1; k > SESSION_CTL_FD; k--)
+        close(k);
+}
 
-    // Open log file in append mode
-    FILE *log_file = fopen("/tmp/yashd.log", "a");
-    if (!log_file) {
-        syslog(LOG_ERR, "Failed to open log file");
-        close(client_socket);
-        pthread_exit(NULL);
+// Send msg with fds attached. Returns -1 if the peer has gone.
+static int send_fds(int sock, const void *msg, size_t len, const int *fds, int nfds) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { (void *)msg, len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
     }
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
 
-    int childpid;
+// Receive a message sent with send_fds(). Slots of fds that did not come
+// are set to -1; the ones that did are close-on-exec.
+static ssize_t recv_fds(int sock, void *msg, size_t len, int *fds, int nfds) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { msg, len };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control) };
+    ssize_t n;
+
+    for (int i = 0; i < nfds; i++) {
+        fds[i] = -1;
+    }
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); n >= 0 && cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            int got = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < got; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                if (i < nfds) {
+                    fds[i] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    return n;
+}
 
-    // Fork the process and create a pseudo-terminal using forkpty()
-    pid = forkpty(&master_fd, NULL, NULL, NULL);
-    childpid = pid;
-    if (pid < 0) {
-        syslog(LOG_ERR, "Forkpty failed");
-        close(client_socket);
-        pthread_exit(NULL);
+// Resource limits for session shells, set with -l. Every command a shell
+// starts inherits them. nproc counts all processes of yashd's user, not
+// just one session's.
+static struct {
+    const char *name;
+    int resource;
+    rlim_t unit;    // -l takes as in megabytes
+    rlim_t value;   // RLIM_INFINITY leaves the limit alone
+} session_limits[] = {
+    { "cpu", RLIMIT_CPU, 1, RLIM_INFINITY },
+    { "as", RLIMIT_AS, 1024 * 1024, RLIM_INFINITY },
+    { "nofile", RLIMIT_NOFILE, 1, RLIM_INFINITY },
+    { "nproc", RLIMIT_NPROC, 1, RLIM_INFINITY },
+};
+#define SESSION_LIMITS (sizeof(session_limits) / sizeof(session_limits[0]))
+
+// Parse "name=value[,name=value...]" for -l
+static int parse_session_limits(char *spec) {
+    for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        size_t i;
+        if (eq == NULL) {
+            return -1;
+        }
+        *eq = '\0';
+        for (i = 0; i < SESSION_LIMITS && strcmp(item, session_limits[i].name) != 0; i++)
+            ;
+        if (i == SESSION_LIMITS) {
+            return -1;
+        }
+
+        // A plain decimal number that still fits once scaled to its unit
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(eq + 1, &end, 10);
+        if (!isdigit((unsigned char)eq[1]) || *end != '\0' || errno == ERANGE ||
+            value > RLIM_INFINITY / session_limits[i].unit) {
+            return -1;
+        }
+        session_limits[i].value = value * session_limits[i].unit;
     }
+    return 0;
+}
 
-    if (pid == 0) {  // Child process: run the shell or command
+// Lower the limits in a new session shell. The CPU hard limit sits one
+// second past the soft one so a runaway gets SIGXCPU before SIGKILL.
+static void apply_session_limits() {
+    for (size_t i = 0; i < SESSION_LIMITS; i++) {
+        struct rlimit rl;
+        if (session_limits[i].value == RLIM_INFINITY) {
+            continue;
+        }
+        rl.rlim_cur = session_limits[i].value;
+        rl.rlim_max = rl.rlim_cur + (session_limits[i].resource == RLIMIT_CPU);
+        if (setrlimit(session_limits[i].resource, &rl) < 0) {
+            syslog(LOG_WARNING, "setrlimit(%s) failed: %d", session_limits[i].name, errno);
+        }
+    }
+}
 
-        //uncomment if you want to run execl insteaf of while loop below
-        /*
-        dup2(master_fd, STDIN_FILENO);
-        dup2(master_fd, STDOUT_FILENO);
-        dup2(master_fd, STDERR_FILENO);
-        setenv("TERM", "dumb", 1);  // Set the terminal type to dumb
-        execl("./ysh", "ysh", (char *)NULL);  // Replace with your shell program
-        syslog(LOG_ERR, "Exec failed");
-        perror("Exec failed");
-        exit(EXIT_FAILURE);
-         */
+// Stdin for the piped line numbered seq: the read end of the pipe yashd
+// sent over the control socket before it queued the line. Pipes of lines
+// that never ran, their input flushed by an interrupt, are skipped.
+static int session_stdin_pipe(unsigned long seq) {
+    unsigned long got;
+    int fd;
 
+    while (recv_fds(SESSION_CTL_FD, &got, sizeof(got), &fd, 1) == sizeof(got)) {
+        if (got == seq && fd >= 0) {
+            return fd;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return open("/dev/null", O_RDONLY);
+}
 
-        // beg of while loop
-        dup2(master_fd, STDIN_FILENO);
-        dup2(master_fd, STDOUT_FILENO);
-        dup2(master_fd, STDERR_FILENO);
+// Run a line the session's shell read. Script and piped lines have their
+// output bracketed with marks carrying the exit status, and their newlines
+// go out bare, without the terminal's CR. A script line from MSG_SCRIPT
+// gets stdin on /dev/null, so the lines queued behind it in the terminal
+// stay commands. A piped line from MSG_PIPED reads a pipe that carries the
+// client's stdin stream byte for byte and ends with it.
+static int eval_session_line(YshContext *shell, char *line) {
+    size_t plen = strlen(SCRIPT_PREFIX);
+    struct termios tio, saved_tio;
+    char *command;
+
+    int piped = (strncmp(line, PIPED_PREFIX, plen) == 0);
+    if (!piped && strncmp(line, SCRIPT_PREFIX, plen) != 0) {
+        return ysh_eval(shell, line);
+    }
+    unsigned long seq = strtoul(line + plen, &command, 10);
+    if (*command == ' ') {
+        command++;
+    }
 
+    int saved_in = dup(STDIN_FILENO);
+    int in_fd = piped ? session_stdin_pipe(seq) : open("/dev/null", O_RDONLY);
+    if (in_fd >= 0) {
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    // Lines queued behind this one must not echo into its output
+    int raw_nl = (tcgetattr(STDOUT_FILENO, &saved_tio) == 0);
+    if (raw_nl) {
+        tio = saved_tio;
+        tio.c_oflag &= ~ONLCR;
+        tio.c_lflag &= ~ECHO;
+        tcsetattr(STDOUT_FILENO, TCSADRAIN, &tio);
+    }
+    printf(PROTO_MARK "b%lu" PROTO_MARK_END, seq);
+    fflush(stdout);
 
-        int cpid;
-        char *inString;
-        char **parsedcmd;
-        int if_bg; //background
+    int status = ysh_eval(shell, command);
 
-        pid_t pgid = 0;
-        pid_t pipe_pids[MAX_PIDS]; //used in pipe for multiple PIDs
+    printf(PROTO_MARK "e%lu;%d" PROTO_MARK_END, seq, status);
+    fflush(stdout);
+    if (raw_nl) {
+        tcsetattr(STDOUT_FILENO, TCSADRAIN, &saved_tio);
+    }
+    if (saved_in >= 0) {
+        dup2(saved_in, STDIN_FILENO);  // Also closes this shell's end of the pipe
+        close(saved_in);
+    }
+    return status;
+}
 
-        // Setup signal handlers
-        signal(SIGINT, sigint_handler);    // Handle Ctrl+C
-        signal(SIGTSTP, sigtstp_handler);  // Handle Ctrl+Z
-        signal(SIGCHLD, sigchld_handler);  // Handle child process cleanup
+// YshIO.run_line for session shells: run the line, time it, then log what
+// the jobs it waited for cost
+static int run_session_line(YshContext *shell, char *line, void *user) {
+    unsigned long done = shell->jobs_done;
+    int blank = (line[strspn(line, " \t")] == '\0');
+    long long start = now_us();
+    int status = eval_session_line(shell, line);
+    long long took = now_us() - start;
+
+    if (!blank && stats.command_us != NULL) {
+        stats_observe(stats.command_us, took);
+    }
+    if (shell->jobs_done != done && shell->current_command_line != NULL) {
+        const struct rusage *ru = &shell->last_usage;
+        syslog(LOG_INFO, "Shell %d: \"%s\" exit %d in %lld.%03llds, user %ld.%03lds sys %ld.%03lds maxrss %ldK",
+               getpid(), shell->current_command_line, status, took / 1000000, took / 1000 % 1000,
+               (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000,
+               (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000, ru->ru_maxrss);
+    }
+    return status;
+}
 
-        char *left_cmd = NULL, *right_cmd = NULL;
+// YshIO.launched for session shells
+static void session_launched(YshContext *shell, unsigned long usec, void *user) {
+    if (stats.launch_us != NULL) {
+        stats_observe(stats.launch_us, usec);
+    }
+}
 
-        while ((inString = readline("# "))) {
+// Body of the forkpty() child: the pty slave is already on stdin/stdout/stderr
+// and the control socket from yashd on SESSION_CTL_FD
+static void run_session_shell() {
+    close_inherited_fds();
+    set_nonblocking(SESSION_CTL_FD);
+    apply_session_limits();
+
+    YshContext shell;
+    YshIO io = { NULL, run_session_line, NULL, session_launched };
+    ysh_init(&shell, &io);
+    ysh_loop(&shell);
+    ysh_free(&shell);
+    exit(EXIT_SUCCESS);
+}
 
-            if (current_command_line != NULL) {
-                free(current_command_line);
-            }
-            current_command_line = strdup(inString);
+// Shell spawner: a helper process forked before yashd starts any thread.
+// Session shells are forked from it, never from yashd, whose threads may
+// hold the malloc, stdio or syslog locks at the moment of a fork and leave
+// the child stuck on them. It stays single-threaded, answers each request
+// with a new shell's pid, pty master and control socket, and reaps the shells.
+static int spawner_sock = -1;
+static pthread_mutex_t spawner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reap session shells. Their usage includes every command they waited for.
+static void spawner_reap() {
+    struct rusage ru;
+    pid_t pid;
 
-            if_bg = 0;
+    while ((pid = wait4(-1, NULL, WNOHANG, &ru)) > 0) {
+        syslog(LOG_INFO, "Shell %d exited: user %ld.%03lds sys %ld.%03lds maxrss %ldK", pid,
+               (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+               (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000, ru.ru_maxrss);
+    }
+}
 
-            if (strcmp(inString, "jobs") == 0) {
-                list_jobs();
-                free(inString);
-                continue;
-            }
+static void spawner_sigchld(int sig) {
+    (void)sig;  // Only there to interrupt ppoll()
+}
 
-            if (strncmp(inString, "fg", 2) == 0) {
-                fg_command();
-                free(inString);
-                continue;
-            }
+// Body of the spawner. SIGCHLD is only let in while it waits, so no exit
+// is missed between reaping and waiting. Returns when yashd goes away.
+static void spawner_main(int sock) {
+    struct sigaction sa;
+    sigset_t chld, waiting;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = spawner_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &waiting);
+    sigdelset(&waiting, SIGCHLD);
 
-            if (strncmp(inString, "bg", 2) == 0) {
-                bg_command();
-                free(inString);
-                continue;
-            }
+    while (1) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        char req;
+
+        spawner_reap();
+        if (ppoll(&pfd, 1, NULL, &waiting) < 0) {
+            continue;  // EINTR: a shell exited
+        }
+        if (recv(sock, &req, 1, 0) <= 0) {
+            return;
+        }
 
-            if (strstr(inString, "&") != NULL) {
-                if_bg = 1;
-                inString[strcspn(inString, "&")] = '\0';  // Remove `&`
+        int fds[2] = { -1, -1 };  // The pty master and yashd's end of the control socket
+        int ctl[2];
+        pid_t pid = -1;
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctl) < 0) {
+            syslog(LOG_ERR, "Control socketpair failed: %s", strerror(errno));
+        } else {
+            pid = forkpty(&fds[0], NULL, NULL, NULL);
+            if (pid == 0) {  // Child process: run the shell
+                close(sock);
+                if (ctl[1] != SESSION_CTL_FD) {
+                    dup2(ctl[1], SESSION_CTL_FD);
+                    fcntl(SESSION_CTL_FD, F_SETFD, FD_CLOEXEC);
+                }
+                signal(SIGPIPE, SIG_DFL);
+                sigprocmask(SIG_UNBLOCK, &chld, NULL);
+                run_session_shell();
+            }
+            if (pid < 0) {
+                syslog(LOG_ERR, "Forkpty failed: %s", strerror(errno));
             }
+            fds[1] = ctl[0];
+            close(ctl[1]);
+        }
+        send_fds(sock, &pid, sizeof(pid), fds, pid > 0 ? 2 : 0);
+        if (pid > 0) {
+            close(fds[0]);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+    }
+}
 
-            if (split_pipe(inString, &left_cmd, &right_cmd)) {
-                // If a pipe is found, split and handle the pipe
-                char **parsed_left_cmd = parse_command(left_cmd);
-                char **parsed_right_cmd = parse_command(right_cmd);
+// Fork the spawner. Must run before any thread is started.
+static void spawner_start() {
+    int sv[2];
 
-                do_pipe(parsed_left_cmd, parsed_right_cmd);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        syslog(LOG_ERR, "Spawner socketpair failed");
+        exit(EXIT_FAILURE);
+    }
+    fflush(NULL);  // Don't let the children inherit unwritten stdio buffers
+    pid_t pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "Spawner fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        spawner_main(sv[1]);
+        _exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+    spawner_sock = sv[0];
+}
 
-                if (if_bg) {
-                    // Add piped command as a background job using the first process's PGID
-                    add_job(pipe_pids[0], inString, RUNNING, 0);
-                } else {
-                    foreground_pid = cpid;
-                    //tcsetpgrp(STDIN_FILENO, getpid());  // Return control to the shell
-                    foreground_pid = -1;
-                }
+// Start a shell on a fresh pty through the spawner. Used by the warm pool's
+// refill thread and directly by session_open() when the pool is empty.
+static pid_t spawn_session_shell(int *master_fd, int *ctl_fd) {
+    long long start = now_us();
+    pid_t pid = -1;
+    int fds[2] = { -1, -1 };
+
+    pthread_mutex_lock(&spawner_lock);
+    if (send(spawner_sock, "s", 1, MSG_NOSIGNAL) == 1 &&
+        recv_fds(spawner_sock, &pid, sizeof(pid), fds, 2) != sizeof(pid)) {
+        pid = -1;
+    }
+    pthread_mutex_unlock(&spawner_lock);
+    if (pid < 0 || fds[0] < 0 || fds[1] < 0) {
+        syslog(LOG_ERR, "No shell from the spawner");
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        return -1;
+    }
+    stats_observe(&stats.shell_spawn_us, now_us() - start);
 
-                free(parsed_left_cmd);
-                free(parsed_right_cmd);
-            }
-            else if ((strstr(inString, "<") != NULL) || (strstr(inString, ">") != NULL)){
-                parsedcmd = parse_command(inString);
-                cpid = fork();
+    *master_fd = fds[0];
+    *ctl_fd = fds[1];
+    set_nonblocking(*master_fd);
+    set_nonblocking(*ctl_fd);
+    return pid;
+}
 
-                if (cpid == 0) {
-                    setpgid(0, 0);  // Set PGID to the child's PID
-                    redirection(parsedcmd);
-                    execvp(parsedcmd[0], parsedcmd);
-                    perror("execvp failed");
-                    exit(EXIT_FAILURE);
-                } else {
-                    setpgid(cpid, cpid);  // Set the PGID of the child to its PID
-                    if (if_bg) {
-                        // If it's a background task, add to jobs list
-                        add_job(cpid, inString, RUNNING, 0);
-                    } else {
-                        // Foreground task
-                        foreground_pid = cpid;
-
-                        waitpid(cpid, NULL, 0);  // Wait for the foreground process to finish
-                        //tcsetpgrp(STDIN_FILENO, getpid());  // Return control to the shell
-                        foreground_pid = -1;
-                    }
-                }
-            }
-            else {
-                parsedcmd = parse_command(inString);  // Parse the command into arguments
-                cpid = fork();
 
-                if (cpid == 0) {
-                    setpgid(0, 0);  //set pgid to child's pid
-                    execvp(parsedcmd[0], parsedcmd);
-                    perror("execvp failed");
-                    exit(EXIT_FAILURE);
-                }
-                else if (cpid > 0) {  // Parent process
-                    setpgid(cpid, cpid);
-
-                    if (if_bg) {
-                        add_job(cpid, inString, RUNNING,0);  // Add the job to the jobs list
-                    } else {
-
-                        pid_t shell_pgrp = tcgetpgrp(STDIN_FILENO);
-                        if (shell_pgrp != getpid()) {
-                            printf("Shell is not in control of the terminal\n");
-                        }
-
-                        foreground_pid = cpid;
-                        //tcsetpgrp(STDIN_FILENO, cpid);
-
-                        int status;
-                        waitpid(cpid, &status, WUNTRACED); // Wait for the foreground job to finish
-                        //tcsetpgrp(STDIN_FILENO, getpid());  // Return control to the shell
-                        foreground_pid = -1;
-                    }
-                } else {
-                    perror("fork failed");
-                }
+// Register, change or drop interest in fd with whichever backend waits
+static void reactor_ctl(reactor_t *r, int op, int fd, ev_tag_t *tag, uint32_t events) {
+    struct epoll_event ev;
 
-                free(parsedcmd);
-            }
+    if (r->uring != NULL) {
+        uring_ctl(r->uring, op, fd, &tag->slot, tag, events);
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = tag;
+    epoll_ctl(r->epoll_fd, op, fd, op == EPOLL_CTL_DEL ? NULL : &ev);
+}
+
+static int reactor_wait(reactor_t *r, struct epoll_event *events, int max, int timeout) {
+    if (r->uring != NULL) {
+        return uring_wait(r->uring, events, max, timeout);
+    }
+    return epoll_wait(r->epoll_fd, events, max, timeout);
+}
 
-            free(inString);
+// Drop events later in the current batch that refer to a tag about to be freed
+static void reactor_forget(reactor_t *r, ev_tag_t *tag) {
+    for (int j = 0; j < r->batch_left; j++) {
+        if (r->batch[j].data.ptr == tag) {
+            r->batch[j].data.ptr = NULL;
         }
+    }
+}
 
-        exit(EXIT_SUCCESS);
-        // end of while loop
+// Up to two iovecs covering len bytes of the ring starting at position pos
+static int ring_iov(char *ring, size_t pos, size_t len, struct iovec *iov) {
+    size_t off = pos & (OUTPUT_RING_SIZE - 1);
+    size_t first = OUTPUT_RING_SIZE - off;
+
+    if (len <= first) {
+        iov[0].iov_base = ring + off;
+        iov[0].iov_len = len;
+        return 1;
     }
+    iov[0].iov_base = ring + off;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = len - first;
+    return 2;
+}
 
-    // Parent process: handle the interaction between client and the shell
-    fd_set read_fds;
-    int max_fd = (client_socket > master_fd) ? client_socket : master_fd;  // Max of both FDs
+// Whether a session has output framed, compressed or waiting in its ring
+static int session_has_output(const session_t *s) {
+    return s->out_head != s->out_tail || s->hdr_off < PROTO_HDR_SIZE || s->zoff < s->zlen ||
+           s->zflush_pending;
+}
 
-    while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        FD_ZERO(&read_fds);  // Clear the set of file descriptors
-        FD_SET(client_socket, &read_fds);  // Add client socket to the set
-        FD_SET(master_fd, &read_fds);  // Add master FD to the set
-
-        // Wait for input on either the client socket or the master FD
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (activity < 0 && errno != EINTR) {
-            syslog(LOG_ERR, "Select error");
-            break;
+// Recompute which pty events a session is interested in. While the output
+// ring is full we stop reading the pty so the shell blocks; a detached
+// session has no socket to wait for and always reads it. A piped
+// command's stdin pipe is waited on while data is queued for it.
+static void session_update_pty(reactor_t *r, session_t *s) {
+    uint32_t pty_events = 0;
+
+    if (s->detached || s->out_head - s->out_tail < OUTPUT_RING_SIZE) {
+        pty_events |= EPOLLIN;
+    }
+    if (s->in_len > s->in_off) {
+        pty_events |= EPOLLOUT;
+    }
+    if (pty_events != s->pty_events) {
+        reactor_ctl(r, EPOLL_CTL_MOD, s->master_fd, &s->pty_ev, pty_events);
+        s->pty_events = pty_events;
+    }
+
+    uint32_t data_events = (s->data_off < s->data_len) ? EPOLLOUT : 0;
+    if (s->data_fd >= 0 && data_events != s->data_events) {
+        reactor_ctl(r, EPOLL_CTL_MOD, s->data_fd, &s->data_ev, data_events);
+        s->data_events = data_events;
+    }
+}
+
+// Recompute which socket events a connection is interested in. The socket
+// is only read while every channel has room for whatever a full reader's
+// worth of frames can queue, so one stalled shell holds back the others.
+static void conn_update_socket(reactor_t *r, conn_t *c) {
+    uint32_t sock_events = c->stalled ? 0 : EPOLLIN;
+
+    if (c->sending != NULL || c->reply_off < c->reply_len) {
+        sock_events |= EPOLLOUT;
+    }
+    for (session_t *s = c->channels; s != NULL; s = s->chan_next) {
+        if (INPUT_BUFFER_SIZE - (s->in_len - s->in_off) < READER_INPUT_MAX(c->reader.cap) ||
+            (s->data_fd >= 0 && INPUT_BUFFER_SIZE - (s->data_len - s->data_off) < c->reader.cap)) {
+            sock_events &= ~EPOLLIN;
         }
+        if (session_has_output(s)) {
+            sock_events |= EPOLLOUT;
+        }
+    }
 
-        // Check if there's data to read from the client socket
-        if (FD_ISSET(client_socket, &read_fds)) {
-            bytes_read = recv(client_socket, buffer, sizeof(buffer), 0);
-            if (bytes_read <= 0) {
-                // Client disconnected
-                syslog(LOG_INFO, "Client disconnected: %s:%d", client_ip, client_port);
-                break;
-            }
-            buffer[bytes_read] = '\0';
+    if (sock_events != c->sock_events) {
+        reactor_ctl(r, EPOLL_CTL_MOD, c->client_socket, &c->sock_ev, sock_events);
+        c->sock_events = sock_events;
+    }
+}
 
-            char *temp_cmd = buffer;  // Default to the original buffer
+static void session_update_events(reactor_t *r, session_t *s) {
+    session_update_pty(r, s);
+    if (s->conn != NULL) {
+        conn_update_socket(r, s->conn);
+    }
+}
 
-            // Check if the buffer starts with "CMD " or "CAT "
-            if (strncmp(buffer, "CMD ", 4) == 0) {
-                temp_cmd = buffer + 4;  // Skip the "CMD " prefix
-            } else if (strncmp(buffer, "CTL ", 4) == 0) {
-                temp_cmd = buffer + 4;  // Skip the "CAT " prefix
-            }
+// Queue a framed control reply behind any still unsent; takes ownership of buf
+static void conn_add_reply(conn_t *c, char *buf, size_t len) {
+    if (c->reply_off == c->reply_len) {
+        free(c->reply);
+        c->reply = buf;
+        c->reply_len = len;
+        c->reply_off = 0;
+        return;
+    }
 
-            // Remove the newline character at the end, if any
-            temp_cmd[strcspn(temp_cmd, "\n")] = '\0';
+    size_t left = c->reply_len - c->reply_off;
+    char *joined = malloc(left + len);
+    if (joined != NULL) {
+        memcpy(joined, c->reply + c->reply_off, left);
+        memcpy(joined + left, buf, len);
+        free(c->reply);
+        c->reply = joined;
+        c->reply_len = left + len;
+        c->reply_off = 0;
+    }
+    free(buf);
+}
 
-            // Log the command to /tmp/yashd.log
-            time(&now);
-            timeinfo = localtime(&now);
-            strftime(time_str, sizeof(time_str), "%b %d %H:%M:%S", timeinfo);  // Format time like syslog
+// Queue a small framed reply built from a string
+static void conn_reply(conn_t *c, unsigned char type, uint16_t channel, const char *text) {
+    size_t len = strlen(text);
+    char *buf = malloc(PROTO_HDR_SIZE + len);
+    if (buf != NULL) {
+        proto_encode_header((unsigned char *)buf, type, channel, len);
+        memcpy(buf + PROTO_HDR_SIZE, text, len);
+        conn_add_reply(c, buf, PROTO_HDR_SIZE + len);
+    }
+}
 
-            // Write log entry
-            fprintf(log_file, "%s yashd[%s:%d]: %s\n", time_str, client_ip, client_port, buffer);
-            fflush(log_file);  // Ensure the log is written immediately
+// Switch a session's output to zlib. Output already framed stays MSG_OUT.
+static int session_start_zlib(session_t *s) {
+    if (s->zout != NULL) {
+        return 0;
+    }
+    z_stream *zs = calloc(1, sizeof(z_stream));
+    char *zbuf = malloc(PROTO_HDR_SIZE + PROTO_MAX_PAYLOAD);
+    if (zs == NULL || zbuf == NULL || deflateInit(zs, ZLIB_LEVEL) != Z_OK) {
+        free(zs);
+        free(zbuf);
+        return -1;
+    }
+    s->zout = zs;
+    s->zbuf = zbuf;
+    return 0;
+}
 
-            if (strcmp(buffer, "EOF\n") == 0) {
-                // If the client sends EOF, stop reading input
-                syslog(LOG_INFO, "EOF received from client: %s:%d", client_ip, client_port);
-                break;
-            }
+// Forget everything about the session's output stream to its client: the
+// frame in flight and compression. The ring contents stay.
+static void session_reset_output(session_t *s) {
+    s->hdr_off = PROTO_HDR_SIZE;
+    s->frame_left = 0;
+    if (s->zout != NULL) {
+        deflateEnd(s->zout);
+        free(s->zout);
+        free(s->zbuf);
+        s->zout = NULL;
+        s->zbuf = NULL;
+    }
+    s->zlen = s->zoff = 0;
+    s->zflush_pending = 0;
+}
 
-            temp_cmd[strcspn(temp_cmd, "\n")] = '\0';
-            size_t len_to_write = strlen(temp_cmd);
+// A session leaving a connection halfway through one of its output frames:
+// the rest of the frame must still go out or the stream is corrupt, so it
+// moves to the front of the replies still queued behind it.
+static void session_spill_frame(conn_t *c, session_t *s) {
+    struct iovec seg[2];
 
-            // Send the command to the child process (running the shell)
-            write(master_fd, temp_cmd, len_to_write);
-        }
+    if (c->sending != s) {
+        return;
+    }
+    c->sending = NULL;
+
+    size_t hdr_left = PROTO_HDR_SIZE - s->hdr_off;
+    size_t len = (s->zoff < s->zlen) ? s->zlen - s->zoff : hdr_left + s->frame_left;
+    size_t queued = c->reply_len - c->reply_off;
+    char *buf = malloc(len + queued);
+    if (buf == NULL) {
+        syslog(LOG_ERR, "Memory allocation failed, output to %s:%d is corrupt", c->client_ip, c->client_port);
+        return;
+    }
 
-        // Check if there's data to read from the master FD (child process output)
-        if (FD_ISSET(master_fd, &read_fds)) {
-            memset(buffer, 0, sizeof(buffer));
-            bytes_read = read(master_fd, buffer, sizeof(buffer) - 1);
-            if (bytes_read > 0) {
-                buffer[bytes_read] = '\0';
-                send(client_socket, buffer, bytes_read, 0);
-                printf("Received from master_fd: '%s'\n", buffer);  // Debugging output
-            }
+    if (s->zoff < s->zlen) {
+        memcpy(buf, s->zbuf + s->zoff, len);
+    } else {
+        memcpy(buf, s->out_hdr + s->hdr_off, hdr_left);
+        int cnt = ring_iov(s->out_ring, s->out_tail, s->frame_left, seg);
+        memcpy(buf + hdr_left, seg[0].iov_base, seg[0].iov_len);
+        if (cnt == 2) {
+            memcpy(buf + hdr_left + seg[0].iov_len, seg[1].iov_base, seg[1].iov_len);
         }
+        s->out_tail += s->frame_left;
     }
+    memcpy(buf + len, c->reply + c->reply_off, queued);
+    free(c->reply);
+    c->reply = buf;
+    c->reply_len = len + queued;
+    c->reply_off = 0;
+
+    s->hdr_off = PROTO_HDR_SIZE;
+    s->frame_left = 0;
+    s->zoff = s->zlen = 0;
+}
 
-    // Clean up after communication ends
-    close(client_socket);
-    close(master_fd);
-    pthread_mutex_lock(&thread_count_lock);
-    thread_count--;
-    pthread_mutex_unlock(&thread_count_lock);
-    pthread_exit(NULL);
+// Put a session on a channel of a connection
+static void session_link(conn_t *c, session_t *s, uint16_t channel) {
+    s->conn = c;
+    s->channel = channel;
+    memcpy(s->client_ip, c->client_ip, sizeof(s->client_ip));
+    s->client_port = c->client_port;
+    c->channel[channel] = s;
+    s->chan_next = c->channels;
+    c->channels = s;
 }
 
+// Take a session off its connection
+static void session_unlink(conn_t *c, session_t *s) {
+    session_spill_frame(c, s);
+    c->channel[s->channel] = NULL;
+    for (session_t **link = &c->channels; *link != NULL; link = &(*link)->chan_next) {
+        if (*link == s) {
+            *link = s->chan_next;
+            break;
+        }
+    }
+    if (c->last_sent == s) {
+        c->last_sent = NULL;
+    }
+    s->conn = NULL;
+    s->chan_next = NULL;
+}
 
+// Close the piped command's stdin pipe, dropping whatever it did not take
+static void session_close_pipe(reactor_t *r, session_t *s) {
+    if (s->data_fd < 0) {
+        return;
+    }
+    if (s->data_len > s->data_off) {
+        syslog(LOG_INFO, "Piped command of %s:%d channel %d left %zu bytes of stdin unread",
+               s->client_ip, s->client_port, s->channel, s->data_len - s->data_off);
+    }
+    reactor_forget(r, &s->data_ev);
+    reactor_ctl(r, EPOLL_CTL_DEL, s->data_fd, &s->data_ev, 0);
+    close(s->data_fd);
+    s->data_fd = -1;
+    s->data_len = s->data_off = 0;
+    s->data_eof = 0;
+}
 
-void run_server() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+// End a session and its shell. A client still attached hears about it.
+static void session_close(reactor_t *r, session_t *s) {
+    syslog(LOG_INFO, "Closing session: %s:%d channel %d", s->client_ip, s->client_port, s->channel);
 
-    // Create the server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        syslog(LOG_ERR, "Socket creation failed");
-        exit(EXIT_FAILURE);
+    if (s->conn != NULL) {
+        conn_reply(s->conn, MSG_CLOSE, s->channel, "");
+        session_unlink(s->conn, s);
+    }
+    reactor_forget(r, &s->pty_ev);
+    reactor_ctl(r, EPOLL_CTL_DEL, s->master_fd, &s->pty_ev, 0);
+    close(s->master_fd);
+    session_close_pipe(r, s);
+    close(s->ctl_fd);
+    kill(s->shell_pid, SIGHUP);
+    free(s->in_buf);
+    free(s->data_buf);
+    if (s->ring_buf >= 0) {
+        uring_buffer_remove(r->uring_io, s->ring_buf);
     }
+    free(s->out_ring);
+    session_reset_output(s);
 
-    // Enable port reuse
-    int reuse = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        r->sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
     }
+    r->session_count--;
+    STATS_ADD(sessions_active, -1);
+    if (s->detached) {
+        r->detached_count--;
+    }
+    free(s);
+}
 
-    // Bind the socket to the specified port
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = ntohs(htons(PORT));
-    server_addr.sin_addr.s_addr = INADDR_ANY;  // Bind to any address
+// The client went away: keep the shell and its output ring for the grace
+// period so a new connection can attach by token.
+static void session_detach(reactor_t *r, session_t *s) {
+    syslog(LOG_INFO, "Detaching session %s:%d channel %d, shell kept for %lld s",
+           s->client_ip, s->client_port, s->channel, r->grace_ms / 1000);
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        syslog(LOG_ERR, "Bind failed");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    session_unlink(s->conn, s);
+    session_reset_output(s);
+
+    s->detached = 1;
+    s->detach_until = now_ms() + r->grace_ms;
+    r->detached_count++;
+    STATS_ADD(detaches, 1);
+    session_update_pty(r, s);
+}
+
+// Tear down a connection. When the client merely vanished, sessions that
+// ran anything worth keeping are detached; the rest are closed.
+static void conn_close(reactor_t *r, conn_t *c, int lost) {
+    int keep = lost && r->grace_ms > 0 && !c->quit;
+
+    syslog(LOG_INFO, "Closing connection: %s:%d", c->client_ip, c->client_port);
+
+    c->sending = NULL;  // The stream ends here; a partial frame no longer matters
+    while (c->channels != NULL) {
+        session_t *s = c->channels;
+        if (keep && s->stats.commands > 0) {
+            session_detach(r, s);
+        } else {
+            session_close(r, s);
+        }
     }
 
-    // Listen for incoming connections
-    if (listen(server_socket, MAX_CONNECTIONS) < 0) {
-        syslog(LOG_ERR, "Listen failed");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    if (c->corked) {
+        r->corked_count--;
     }
+    if (c->flush_queued) {
+        conn_t **p = &r->flushing;
+        while (*p != c) {
+            p = &(*p)->flush_next;
+        }
+        *p = c->flush_next;
+    }
+    reactor_forget(r, &c->sock_ev);
+    reactor_ctl(r, EPOLL_CTL_DEL, c->client_socket, &c->sock_ev, 0);
+    close(c->client_socket);
+    proto_reader_free(&c->reader);
+    free(c->reply);
+    free(c);
+    STATS_ADD(connections_active, -1);
+}
 
-    syslog(LOG_INFO, "Server listening on port %d", PORT);
-    printf("Server listening on port %d", PORT);
-    fflush(stdout);
+// Start a shell on a channel of the connection and register its pty
+static session_t *session_open(reactor_t *r, conn_t *c, uint16_t channel) {
+    if (r->session_count >= r->max_sessions) {
+        syslog(LOG_WARNING, "Maximum sessions reached, refusing channel %d for %s:%d",
+               channel, c->client_ip, c->client_port);
+        return NULL;
+    }
 
-    // Accept and handle incoming connections
-    while (1) {
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            syslog(LOG_ERR, "Accept failed with error: %d", errno);
-            continue;
+    session_t *s = calloc(1, sizeof(session_t));
+    if (s == NULL) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return NULL;
+    }
+
+    s->in_buf = malloc(INPUT_BUFFER_SIZE);
+    s->out_ring = malloc(OUTPUT_RING_SIZE);
+    if (s->in_buf == NULL || s->out_ring == NULL) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        free(s->in_buf);
+        free(s->out_ring);
+        free(s);
+        return NULL;
+    }
+    s->hdr_off = PROTO_HDR_SIZE;  // No frame in progress
+
+    // Prefer a warm shell from the pool; fall back to starting one now
+    int warm = pool_take(&s->master_fd, &s->ctl_fd, &s->shell_pid) == 0;
+    if (!warm) {
+        s->shell_pid = spawn_session_shell(&s->master_fd, &s->ctl_fd);
+        if (s->shell_pid < 0) {
+            free(s->in_buf);
+            free(s->out_ring);
+            free(s);
+            return NULL;
         }
+    }
 
-        syslog(LOG_INFO, "Client connected");
+    syslog(LOG_INFO, "Handling client: %s:%d channel %d (%s shell, pool %lu hits, %lu misses)",
+           c->client_ip, c->client_port, channel, warm ? "warm" : "cold", pool_hits(), pool_misses());
 
-        // Allocate memory for the client info
-        client_t *client_info = malloc(sizeof(client_t));
-        if (client_info == NULL) {
-            syslog(LOG_ERR, "Memory allocation failed");
-            close(client_socket);
-            continue;
+    // Past the slots or RLIMIT_MEMLOCK the ring is read and written unregistered
+    s->ring_buf = r->uring_io != NULL ? uring_buffer_add(r->uring_io, s->out_ring, OUTPUT_RING_SIZE) : -1;
+
+    s->pty_ev.kind = EV_PTY;
+    s->pty_ev.session = s;
+    s->data_ev.kind = EV_PIPE;
+    s->data_ev.session = s;
+    s->data_fd = -1;
+
+    s->pty_events = EPOLLIN;
+    reactor_ctl(r, EPOLL_CTL_ADD, s->master_fd, &s->pty_ev, EPOLLIN);
+
+    s->next = r->sessions;
+    if (r->sessions) {
+        r->sessions->prev = s;
+    }
+    r->sessions = s;
+    r->session_count++;
+    s->stats.opened_ms = now_ms();
+    STATS_ADD(sessions_active, 1);
+    STATS_ADD(sessions_total, 1);
+
+    session_link(c, s, channel);
+    if (c->want_zlib) {
+        session_start_zlib(s);
+    }
+
+    // Tell the client how to get back to this session after a disconnect
+    unsigned char raw[TOKEN_BYTES];
+    if (getrandom(raw, sizeof(raw), 0) == sizeof(raw)) {
+        for (int i = 0; i < TOKEN_BYTES; i++) {
+            sprintf(s->token + 2 * i, "%02x", raw[i]);
         }
+        conn_reply(c, MSG_SESSION, channel, s->token);
+    }
+    return s;
+}
 
-        client_info->client_socket = client_socket;
-        inet_ntop(AF_INET, &(client_addr.sin_addr), client_info->client_ip, INET_ADDRSTRLEN);
-        client_info->client_port = ntohs(client_addr.sin_port);
+// Register a freshly accepted client; its first shell opens on channel 0
+static conn_t *conn_open(reactor_t *r, int client_socket, const char *ip, int port) {
+    conn_t *c = calloc(1, sizeof(conn_t));
+    if (c == NULL || proto_reader_init(&c->reader) < 0) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        free(c);
+        return NULL;
+    }
 
-        // Limit the number of threads (clients)
-        pthread_mutex_lock(&thread_count_lock);
-        if (thread_count >= MAX_CONNECTIONS) {
-            syslog(LOG_WARNING, "Maximum client connections reached, rejecting client.");
-            close(client_socket);
-            free(client_info);
-            pthread_mutex_unlock(&thread_count_lock);
-            continue;
+    c->client_socket = client_socket;
+    snprintf(c->client_ip, sizeof(c->client_ip), "%s", ip);
+    c->client_port = port;
+    c->local = (strcmp(ip, "local") == 0);
+
+    if (session_open(r, c, 0) == NULL) {
+        proto_reader_free(&c->reader);
+        free(c->reply);
+        free(c);
+        return NULL;
+    }
+
+    c->sock_ev.kind = EV_SOCKET;
+    c->sock_ev.conn = c;
+
+    c->sock_events = EPOLLIN;
+    reactor_ctl(r, EPOLL_CTL_ADD, client_socket, &c->sock_ev, EPOLLIN);
+    conn_update_socket(r, c);
+    STATS_ADD(connections_active, 1);
+    return c;
+}
+
+// Write queued client input into the pty until it is drained or full.
+// Returns -1 once the shell side has gone away.
+static int session_flush_input(session_t *s) {
+    while (s->in_off < s->in_len) {
+        ssize_t n = write(s->master_fd, s->in_buf + s->in_off, s->in_len - s->in_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return 0;  // Terminal input queue is full; wait for EPOLLOUT
+            }
+            syslog(LOG_ERR, "Write to pty failed for %s:%d", s->client_ip, s->client_port);
+            return -1;
         }
-        int thread_index = thread_count++;
-        pthread_mutex_unlock(&thread_count_lock);
+        s->in_off += n;
+    }
+    s->in_off = s->in_len = 0;
+    return 0;
+}
 
-        // Create a thread to handle the client
-        int ret = pthread_create(&client_threads[thread_index], NULL, handle_client, (void *)client_info);
-        if (ret != 0) {
-            syslog(LOG_ERR, "Failed to create thread: %s", strerror(ret));
-            close(client_socket);
-            free(client_info);
-            pthread_mutex_lock(&thread_count_lock);
-            thread_count--;  // Decrement count in case of failure
-            pthread_mutex_unlock(&thread_count_lock);
-            continue;
+// Room left for pty input once what was written is compacted away
+static size_t session_input_room(const session_t *s) {
+    return INPUT_BUFFER_SIZE - (s->in_len - s->in_off);
+}
+
+// Queue bytes for the shell's terminal, preserving arrival order. Frames
+// are only handled when session_input_room() covers them; anything that
+// still does not fit is dropped rather than overrun the buffer.
+static void session_queue_input(session_t *s, const char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (len > session_input_room(s)) {
+        syslog(LOG_ERR, "Input overflow for %s:%d channel %d, %zu bytes dropped",
+               s->client_ip, s->client_port, s->channel, len);
+        return;
+    }
+    if (s->in_len + len > INPUT_BUFFER_SIZE) {
+        memmove(s->in_buf, s->in_buf + s->in_off, s->in_len - s->in_off);
+        s->in_len -= s->in_off;
+        s->in_off = 0;
+    }
+    memcpy(s->in_buf + s->in_len, data, len);
+    s->in_len += len;
+}
+
+// Give the piped line seq a fresh pipe for its stdin. The read end goes to
+// the shell over the control socket ahead of the line itself; a stream
+// still open from an earlier piped line is cut off. Returns -1 if the
+// shell cannot be handed a pipe.
+static int session_open_pipe(reactor_t *r, session_t *s, unsigned long seq) {
+    int p[2];
+
+    session_close_pipe(r, s);
+    if (s->data_buf == NULL && (s->data_buf = malloc(INPUT_BUFFER_SIZE)) == NULL) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    if (pipe2(p, O_CLOEXEC) < 0) {
+        syslog(LOG_ERR, "Stdin pipe for %s:%d failed: %s", s->client_ip, s->client_port, strerror(errno));
+        return -1;
+    }
+    int rc = send_fds(s->ctl_fd, &seq, sizeof(seq), &p[0], 1);
+    close(p[0]);
+    if (rc < 0) {
+        syslog(LOG_ERR, "Cannot pass stdin to shell %d: %s", s->shell_pid, strerror(errno));
+        close(p[1]);
+        return -1;
+    }
+    set_nonblocking(p[1]);
+    s->data_fd = p[1];
+    // Nothing to write yet; registered for the error that a closed read end raises
+    s->data_events = 0;
+    reactor_ctl(r, EPOLL_CTL_ADD, s->data_fd, &s->data_ev, 0);
+    return 0;
+}
+
+// Write queued stdin data into the pipe until it is drained or full, and
+// close the pipe behind the end of the stream. A command that quit reading
+// makes the rest of its stream go nowhere.
+static void session_flush_data(reactor_t *r, session_t *s) {
+    while (s->data_fd >= 0 && s->data_off < s->data_len) {
+        ssize_t n = write(s->data_fd, s->data_buf + s->data_off, s->data_len - s->data_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                session_close_pipe(r, s);  // EPIPE: nobody reads it any more
+            }
+            return;
         }
+        s->data_off += n;
+    }
+    s->data_off = s->data_len = 0;
+    if (s->data_eof) {
+        session_close_pipe(r, s);
+    }
+}
 
-        // Optionally detach the thread to clean up resources after it exits
-        pthread_detach(client_threads[thread_index]);
+// Room left for stdin data; unlimited without a pipe, where it is dropped
+static size_t session_data_room(const session_t *s) {
+    return s->data_fd < 0 ? INPUT_BUFFER_SIZE : INPUT_BUFFER_SIZE - (s->data_len - s->data_off);
+}
+
+// Queue stdin data for the piped command
+static void session_queue_data(session_t *s, const char *data, size_t len) {
+    if (s->data_fd < 0 || len == 0) {
+        return;
     }
+    if (s->data_len + len > INPUT_BUFFER_SIZE) {
+        memmove(s->data_buf, s->data_buf + s->data_off, s->data_len - s->data_off);
+        s->data_len -= s->data_off;
+        s->data_off = 0;
+    }
+    memcpy(s->data_buf + s->data_len, data, len);
+    s->data_len += len;
+}
 
-    // Close the server socket when shutting down
-    close(server_socket);
+// Whether a frame fits in what the session has queued for its shell
+static int session_has_room(const session_t *s, const frame_t *f) {
+    if (f->type == MSG_DATA) {
+        return session_data_room(s) >= f->len;
+    }
+    return session_input_room(s) >= FRAME_INPUT_MAX(f->len);
 }
 
+// Queue a command for /tmp/yashd.log; the logger thread does the writing
+static void log_command(session_t *s, const frame_t *f) {
+    logger_submit(s->client_ip, s->client_port, f->payload, f->len);
+}
 
-int main(){
-    //create_daemon();
-    run_server();  // Start the server
+// Follow what a raw-terminal client types, closely enough to log and count
+// the lines it enters. Editing beyond backspace and Ctrl-U is not tracked,
+// and arrow keys and other escape sequences are left out.
+static void session_track_keys(session_t *s, const char *keys, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = keys[i];
+
+        if (s->typed_esc == 1) {
+            s->typed_esc = (c == '[' || c == 'O') ? 2 : 0;
+        } else if (s->typed_esc == 2) {
+            if (c >= 0x40 && c <= 0x7e) {
+                s->typed_esc = 0;
+            }
+        } else if (c == '\r' || c == '\n') {
+            if (s->typed_len > 0) {
+                logger_submit(s->client_ip, s->client_port, s->typed, s->typed_len);
+                STATS_ADD(commands, 1);
+                s->stats.commands++;
+            }
+            s->typed_len = 0;
+        } else if (c == 0x7f || c == '\b') {
+            if (s->typed_len > 0) {
+                s->typed_len--;
+            }
+        } else if (c == 0x15 || c == 0x03) {
+            s->typed_len = 0;  // Ctrl-U or Ctrl-C drops the line
+        } else if (c == 0x1b) {
+            s->typed_esc = 1;
+        } else if (c >= 0x20 && s->typed_len < TYPED_MAX) {
+            s->typed[s->typed_len++] = c;
+        }
+    }
+}
+
+// Render counters into a malloc'd buffer: the server-wide set, then either
+// one session or all of them. The buffer starts with room for a frame header.
+static char *render_stats(reactor_t *r, session_t *only, size_t *len) {
+    char *buf = NULL;
+    char label[INET_ADDRSTRLEN + 16];
+    long long now = now_ms();
+
+    FILE *fp = open_memstream(&buf, len);
+    if (fp == NULL) {
+        return NULL;
+    }
+    fprintf(fp, "%*s", PROTO_HDR_SIZE, "");
+    stats_format(fp);
+    stats_format_counter(fp, "yashd_pool_hits_total", "counter", "Sessions given a warm shell", pool_hits());
+    stats_format_counter(fp, "yashd_pool_misses_total", "counter", "Sessions that had to start a shell", pool_misses());
+    stats_format_counter(fp, "yashd_log_dropped_total", "counter", "Audit log records dropped", logger_dropped());
+    stats_format_counter(fp, "yashd_admission_waiting", "gauge", "Connections waiting for a session", r->queue_count);
+    for (session_t *s = r->sessions; s != NULL; s = s->next) {
+        if (only == NULL || s == only) {
+            snprintf(label, sizeof(label), "%s:%d/%d", s->client_ip, s->client_port, s->channel);
+            stats_format_session(fp, label, &s->stats, now);
+        }
+    }
+    fclose(fp);
+    return buf;
+}
+
+// Agree on output compression for every channel of the connection,
+// including ones opened later
+static void conn_hello(conn_t *c, const frame_t *f) {
+    if (memmem(f->payload, f->len, "zlib", 4) != NULL) {
+        c->want_zlib = 1;
+        for (session_t *s = c->channels; s != NULL; s = s->chan_next) {
+            session_start_zlib(s);
+        }
+    }
+    conn_reply(c, MSG_HELLO, f->channel, c->want_zlib ? "zlib" : "");
+}
+
+// Answer a stats request with a MSG_STATS frame for this session
+static void session_queue_stats(reactor_t *r, session_t *s) {
+    size_t len;
+
+    char *buf = render_stats(r, s, &len);
+    if (buf == NULL) {
+        return;
+    }
+    if (len - PROTO_HDR_SIZE > PROTO_MAX_PAYLOAD) {
+        len = PROTO_HDR_SIZE + PROTO_MAX_PAYLOAD;
+    }
+    proto_encode_header((unsigned char *)buf, MSG_STATS, s->channel, len - PROTO_HDR_SIZE);
+    conn_add_reply(s->conn, buf, len);
+}
+
+// Act on one frame addressed to a session's channel
+static void session_handle_frame(reactor_t *r, session_t *s, const frame_t *f) {
+    struct termios tio;
+    char key;
+
+    switch (f->type) {
+    case MSG_CMD:
+    case MSG_SCRIPT:
+    case MSG_PIPED:
+        log_command(s, f);
+        STATS_ADD(commands, 1);
+        s->stats.commands++;
+        // Send the command line to the child process (running the shell).
+        // Script and piped lines queue up in the terminal behind the
+        // running one; a piped line's stdin comes through its own pipe, and
+        // without one it runs as a script line.
+        if (f->type == MSG_PIPED && session_open_pipe(r, s, strtoul(f->payload, NULL, 10)) == 0) {
+            session_queue_input(s, PIPED_PREFIX, strlen(PIPED_PREFIX));
+        } else if (f->type != MSG_CMD) {
+            session_queue_input(s, SCRIPT_PREFIX, strlen(SCRIPT_PREFIX));
+        }
+        session_queue_input(s, f->payload, f->len);
+        session_queue_input(s, "\n", 1);
+        break;
+
+    case MSG_KEYS:
+        // The client's terminal is raw: the pty does the echoing, line
+        // editing and signal keys, so keystrokes go straight in
+        session_track_keys(s, f->payload, f->len);
+        session_queue_input(s, f->payload, f->len);
+        break;
+
+    case MSG_DATA:
+        // Raw stdin for the piped command
+        session_queue_data(s, f->payload, f->len);
+        break;
+
+    case MSG_EOF:
+        if (s->data_fd >= 0) {
+            s->data_eof = 1;  // The pipe closes once the command has been given everything
+        }
+        break;
+
+    case MSG_CLOSE:
+        session_close(r, s);
+        break;
+
+    case MSG_CTL:
+        log_command(s, f);
+        if (f->len != 1 || tcgetattr(s->master_fd, &tio) < 0) {
+            break;
+        }
+        // Type the terminal's own interrupt/suspend character so the line
+        // discipline signals the shell
+        if (f->payload[0] == 'c') {
+            key = tio.c_cc[VINTR];
+        } else if (f->payload[0] == 'z') {
+            key = tio.c_cc[VSUSP];
+        } else if (f->payload[0] == 's') {
+            session_queue_stats(r, s);
+            break;
+        } else {
+            break;
+        }
+        session_queue_input(s, &key, 1);
+        break;
+
+    default:
+        syslog(LOG_WARNING, "Unknown frame type %d from %s:%d", f->type, s->client_ip, s->client_port);
+        break;
+    }
+}
+
+// Put the detached session named in an attach request on the requested
+// channel, replacing whatever shell the channel held. Replay resumes from
+// the client's output offset, or from the oldest byte still in the ring
+// if it has been overwritten since.
+static void session_attach(reactor_t *r, conn_t *c, const frame_t *f) {
+    char req[128], token[2 * TOKEN_BYTES + 1];
+    unsigned long long offset = 0;
+    session_t *t = NULL;
+
+    size_t len = f->len < sizeof(req) - 1 ? f->len : sizeof(req) - 1;
+    memcpy(req, f->payload, len);
+    req[len] = '\0';
+    if (f->channel < PROTO_MAX_CHANNELS && sscanf(req, "%32s %llu", token, &offset) >= 1) {
+        for (t = r->sessions; t != NULL; t = t->next) {
+            if (t->detached && strcmp(t->token, token) == 0) {
+                break;
+            }
+        }
+    }
+    if (t == NULL) {
+        syslog(LOG_INFO, "No detached session for attach from %s:%d", c->client_ip, c->client_port);
+        conn_reply(c, MSG_ATTACH, f->channel, "");  // Unknown or expired token
+        return;
+    }
+
+    session_t *old = c->channel[f->channel];
+    if (old != NULL) {
+        session_unlink(c, old);  // Quietly: the client knows it is being replaced
+        session_close(r, old);
+    }
+
+    t->detached = 0;
+    r->detached_count--;
+    session_link(c, t, f->channel);
+    if (c->want_zlib) {
+        session_start_zlib(t);
+    }
+
+    size_t oldest = t->out_head > OUTPUT_RING_SIZE ? t->out_head - OUTPUT_RING_SIZE : 0;
+    if (offset > t->out_head) {
+        offset = t->out_head;
+    }
+    if (offset < oldest) {
+        offset = oldest;
+    }
+    t->out_tail = offset;
+
+    snprintf(req, sizeof(req), "%llu %zu", offset, t->out_head);
+    conn_reply(c, MSG_ATTACH, f->channel, req);
+    syslog(LOG_INFO, "Reattached session from %s:%d channel %d, replaying %zu bytes",
+           t->client_ip, t->client_port, t->channel, t->out_head - t->out_tail);
+    STATS_ADD(reattaches, 1);
+}
+
+// Act on one frame from the client: connection-wide requests here, the
+// rest go to the session on the frame's channel
+static void conn_handle_frame(reactor_t *r, conn_t *c, const frame_t *f) {
+    session_t *s = (f->channel < PROTO_MAX_CHANNELS) ? c->channel[f->channel] : NULL;
+
+    switch (f->type) {
+    case MSG_HELLO:
+        conn_hello(c, f);
+        return;
+
+    case MSG_ATTACH:
+        session_attach(r, c, f);
+        return;
+
+    case MSG_OPEN:
+        if (f->channel >= PROTO_MAX_CHANNELS || s != NULL) {
+            syslog(LOG_WARNING, "Channel %d unavailable for %s:%d", f->channel, c->client_ip, c->client_port);
+            conn_reply(c, MSG_CLOSE, f->channel, "");
+        } else if (session_open(r, c, f->channel) == NULL) {
+            conn_reply(c, MSG_CLOSE, f->channel, "");
+        }
+        return;
+
+    case MSG_CTL:
+        if (f->len == 1 && f->payload[0] == 'q') {
+            c->quit = 1;  // The client is done: no point keeping its shells
+            return;
+        }
+        break;
+    }
+
+    if (s == NULL) {
+        syslog(LOG_WARNING, "Frame for unknown channel %d from %s:%d", f->channel, c->client_ip, c->client_port);
+        return;
+    }
+    s->stats.bytes_in += PROTO_HDR_SIZE + f->len;
+    session_handle_frame(r, s, f);
+}
+
+// Decode every complete frame in the reader and push the input it carried
+// into each channel's pty or stdin pipe. A frame whose shell has no room for it stays in
+// the reader, and the connection is stalled until that shell drains.
+// Returns SESSION_CLOSE on a malformed stream or a quitting client.
+static int conn_handle_frames(reactor_t *r, conn_t *c) {
+    frame_t f;
+    int rc;
+
+    c->stalled = 0;
+    while (1) {
+        size_t start = c->reader.start;
+        if ((rc = proto_next(&c->reader, &f)) <= 0) {
+            break;
+        }
+        session_t *s = (f.channel < PROTO_MAX_CHANNELS) ? c->channel[f.channel] : NULL;
+        if (s != NULL && !session_has_room(s, &f)) {
+            c->reader.start = start;
+            c->stalled = 1;
+            break;
+        }
+        conn_handle_frame(r, c, &f);
+    }
+    if (rc < 0) {
+        syslog(LOG_WARNING, "Malformed frame from %s:%d", c->client_ip, c->client_port);
+        return SESSION_CLOSE;
+    }
+    if (c->quit) {
+        return SESSION_CLOSE;
+    }
+
+    session_t *next;
+    for (session_t *s = c->channels; s != NULL; s = next) {
+        next = s->chan_next;
+        if (session_flush_input(s) < 0) {
+            session_close(r, s);
+            continue;
+        }
+        session_flush_data(r, s);
+        session_update_pty(r, s);
+    }
+    conn_update_socket(r, c);
+    return 0;
+}
+
+// Client socket is readable: take in what arrived and act on it.
+// Returns SESSION_DETACH when the client has gone away.
+static int conn_read_socket(reactor_t *r, conn_t *c) {
+    ssize_t bytes_read = proto_reader_fill(&c->reader, c->client_socket);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (bytes_read <= 0) {
+        // Client disconnected
+        syslog(LOG_INFO, "Client disconnected: %s:%d", c->client_ip, c->client_port);
+        return SESSION_DETACH;
+    }
+    STATS_ADD(bytes_in, bytes_read);
+    return conn_handle_frames(r, c);
+}
+
+// Send as much of buf as the socket takes. Returns -1 on a dead socket.
+static int conn_send(conn_t *c, session_t *s, const char *buf, size_t *off, size_t len) {
+    while (*off < len) {
+        ssize_t n = send(c->client_socket, buf + *off, len - *off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            return -1;
+        }
+        *off += n;
+        STATS_ADD(bytes_out, n);
+        if (c->corked) {
+            STATS_ADD(coalesced_bytes, n);
+        }
+        if (s != NULL) {
+            s->stats.bytes_out += n;
+        }
+    }
+    return 0;
+}
+
+// Compress the next stretch of the ring into zbuf as one MSG_ZOUT frame.
+// The stream is sync-flushed whenever it catches up with the ring, which
+// covers every prompt, so interactive output is never held back; while
+// more output is queued, zlib is free to buffer across reads.
+static void session_compress(session_t *s) {
+    z_stream *zs = s->zout;
+
+    while (s->zoff == s->zlen) {
+        size_t pending = s->out_head - s->out_tail;
+        if (pending == 0 && !s->zflush_pending) {
+            return;
+        }
+
+        struct iovec seg[2];
+        size_t take = 0;
+        if (pending > 0) {
+            ring_iov(s->out_ring, s->out_tail, pending, seg);
+            take = seg[0].iov_len;  // Contiguous part only; the rest comes next round
+        }
+        int flush = (take == pending) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        zs->next_in = take ? (Bytef *)seg[0].iov_base : Z_NULL;
+        zs->avail_in = take;
+        zs->next_out = (Bytef *)s->zbuf + PROTO_HDR_SIZE;
+        zs->avail_out = PROTO_MAX_PAYLOAD;
+        deflate(zs, flush);
+
+        size_t consumed = take - zs->avail_in;
+        size_t produced = PROTO_MAX_PAYLOAD - zs->avail_out;
+        s->out_tail += consumed;
+        s->zflush_pending = (flush == Z_SYNC_FLUSH && zs->avail_out == 0);
+
+        STATS_ADD(zlib_in, consumed);
+        STATS_ADD(zlib_out, produced);
+        s->stats.zlib_in += consumed;
+        s->stats.zlib_out += produced;
+
+        if (produced > 0) {
+            proto_encode_header((unsigned char *)s->zbuf, MSG_ZOUT, s->channel, produced);
+            s->zlen = PROTO_HDR_SIZE + produced;
+            s->zoff = 0;
+        }
+    }
+}
+
+// Account for n bytes of a MSG_OUT frame written to the socket. Returns 1
+// once the frame is out.
+static int session_frame_sent(conn_t *c, session_t *s, size_t n) {
+    STATS_ADD(bytes_out, n);
+    if (c->corked) {
+        STATS_ADD(coalesced_bytes, n);
+    }
+    s->stats.bytes_out += n;
+
+    size_t hdr_part = PROTO_HDR_SIZE - s->hdr_off;
+    if (n < hdr_part) {
+        s->hdr_off += n;
+        return 0;
+    }
+    s->hdr_off = PROTO_HDR_SIZE;
+    n -= hdr_part;
+    s->out_tail += n;
+    s->frame_left -= n;
+    return s->frame_left == 0;  // Anything left means the socket buffer is full
+}
+
+// Send (the rest of) one output frame of a session. A MSG_OUT frame's
+// header and payload go out in one writev() straight from the ring, or
+// while the reactor batches writes, as a write request on uring_io that
+// reactor_write_batch() finishes. A session that negotiated zlib sends a
+// MSG_ZOUT frame from zbuf instead. Returns 1 once the frame is out (or
+// there was nothing to send), 0 when the socket is full or the write was
+// queued and -1 on a dead socket.
+static int session_send_frame(reactor_t *r, conn_t *c, session_t *s) {
+    struct iovec iov[3];
+
+    if (s->zout != NULL && s->hdr_off == PROTO_HDR_SIZE && s->frame_left == 0) {
+        if (s->zoff == s->zlen) {
+            session_compress(s);
+            if (s->zoff == s->zlen) {
+                return 1;
+            }
+        }
+        if (conn_send(c, s, s->zbuf, &s->zoff, s->zlen) < 0) {
+            return -1;
+        }
+        if (s->zoff < s->zlen) {
+            return 0;
+        }
+        s->zoff = s->zlen = 0;
+        return 1;
+    }
+
+    if (s->hdr_off == PROTO_HDR_SIZE && s->frame_left == 0) {
+        size_t pending = s->out_head - s->out_tail;
+        if (pending == 0) {
+            return 1;
+        }
+        s->frame_left = pending < PROTO_MAX_PAYLOAD ? pending : PROTO_MAX_PAYLOAD;
+        proto_encode_header(s->out_hdr, MSG_OUT, s->channel, s->frame_left);
+        s->hdr_off = 0;
+    }
+
+    int cnt = 0;
+    if (s->hdr_off < PROTO_HDR_SIZE) {
+        iov[0].iov_base = s->out_hdr + s->hdr_off;
+        iov[0].iov_len = PROTO_HDR_SIZE - s->hdr_off;
+        cnt = 1;
+    }
+    cnt += ring_iov(s->out_ring, s->out_tail, s->frame_left, iov + cnt);
+
+    if (r->batch_writes &&
+        uring_write(r->uring_io, c->client_socket, iov, cnt, s->ring_buf, &c->write_res) == 0) {
+        c->write_queued = 1;
+        return 0;
+    }
+    ssize_t n = writev(c->client_socket, iov, cnt);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+    return session_frame_sent(c, s, n);
+}
+
+// Next channel with output, taking turns after the one served last
+static session_t *conn_next_ready(conn_t *c) {
+    session_t *start = (c->last_sent != NULL && c->last_sent->chan_next != NULL)
+                       ? c->last_sent->chan_next : c->channels;
+    session_t *s = start;
+
+    if (s == NULL) {
+        return NULL;
+    }
+    do {
+        if (session_has_output(s)) {
+            return s;
+        }
+        s = (s->chan_next != NULL) ? s->chan_next : c->channels;
+    } while (s != start);
+    return NULL;
+}
+
+// Sockets run with TCP_NODELAY so echo and prompts leave at once. When a
+// connection has a backlog of bulk output, TCP_CORK is set on top so the
+// frames pack into full segments instead of one short segment per pty
+// read; the flush timer takes it off again.
+static void conn_cork(reactor_t *r, conn_t *c) {
+    size_t pending = 0;
+    int on = 1;
+
+    if (c->corked || c->local || r->cork_bytes == 0) {
+        return;
+    }
+    for (session_t *s = c->channels; s != NULL; s = s->chan_next) {
+        pending += s->out_head - s->out_tail;
+    }
+    if (pending < r->cork_bytes ||
+        setsockopt(c->client_socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0) {
+        return;
+    }
+    c->corked = 1;
+    c->uncork_at = now_ms() + r->cork_ms;
+    r->corked_count++;
+    STATS_ADD(tcp_corks, 1);
+}
+
+// Flush timer expired: push out whatever the cork still holds. A backlog
+// that is still there corks the connection again on the next flush.
+static void conn_uncork(reactor_t *r, conn_t *c) {
+    int off = 0;
+
+    setsockopt(c->client_socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    c->corked = 0;
+    r->corked_count--;
+    STATS_ADD(tcp_cork_flushes, 1);
+}
+
+// Rings that drained can take pty output again
+static void conn_update_events(reactor_t *r, conn_t *c) {
+    for (session_t *s = c->channels; s != NULL; s = s->chan_next) {
+        session_update_pty(r, s);
+    }
+    conn_update_socket(r, c);
+}
+
+// Push buffered output of every channel to the client, one frame per
+// channel in turn so a busy shell cannot starve the others. Control
+// replies slot in between frames. Returns SESSION_DETACH on a dead socket.
+static int conn_flush(reactor_t *r, conn_t *c) {
+    conn_cork(r, c);
+    while (1) {
+        if (c->sending == NULL) {
+            if (conn_send(c, NULL, c->reply, &c->reply_off, c->reply_len) < 0) {
+                return SESSION_DETACH;
+            }
+            if (c->reply_off < c->reply_len) {
+                break;
+            }
+            c->sending = conn_next_ready(c);
+            if (c->sending == NULL) {
+                break;
+            }
+        }
+
+        session_t *s = c->sending;
+        int rc = session_send_frame(r, c, s);
+        if (rc < 0) {
+            return SESSION_DETACH;
+        }
+        if (rc == 0) {
+            break;
+        }
+        c->sending = NULL;
+        c->last_sent = s;
+    }
+    conn_update_events(r, c);
+    return 0;
+}
+
+// Flush a connection now, or queue it for reactor_write_batch() when
+// writes are batched on io_uring. Returns SESSION_DETACH on a dead socket.
+static int conn_want_flush(reactor_t *r, conn_t *c) {
+    if (r->uring_io == NULL) {
+        return conn_flush(r, c);
+    }
+    if (!c->flush_queued) {
+        c->flush_queued = 1;
+        c->flush_next = r->flushing;
+        r->flushing = c;
+    }
+    return 0;
+}
+
+// Flush every connection queued by the last batch of events. Each round
+// puts one MSG_OUT frame per connection on uring_io and writes them all
+// in one io_uring_enter(); connections that got a whole frame out go
+// again, as conn_flush() would have.
+static void reactor_write_batch(reactor_t *r) {
+    while (r->flushing != NULL) {
+        conn_t *writing = NULL;
+        conn_t *next;
+        conn_t *list = r->flushing;
+
+        r->flushing = NULL;
+        r->batch_writes = 1;
+        for (conn_t *c = list; c != NULL; c = next) {
+            next = c->flush_next;
+            c->flush_queued = 0;
+            if (conn_flush(r, c) < 0) {
+                conn_close(r, c, 1);
+            } else if (c->write_queued) {
+                c->flush_next = writing;
+                writing = c;
+            }
+        }
+        r->batch_writes = 0;
+        if (writing == NULL) {
+            break;
+        }
+
+        uring_transfer(r->uring_io);
+        for (conn_t *c = writing; c != NULL; c = next) {
+            next = c->flush_next;
+            c->write_queued = 0;
+            if (c->write_res < 0 && c->write_res != -EAGAIN && c->write_res != -EINTR) {
+                conn_close(r, c, 1);
+                continue;
+            }
+            session_t *s = c->sending;
+            if (c->write_res > 0 && session_frame_sent(c, s, c->write_res)) {
+                c->sending = NULL;
+                c->last_sent = s;
+                conn_want_flush(r, c);
+            } else {
+                conn_update_events(r, c);
+            }
+        }
+    }
+}
+
+// The shell wrote n more bytes into the ring at out_head
+static void session_add_output(session_t *s, size_t n) {
+    s->out_head += n;
+    if (s->out_head - s->out_tail > OUTPUT_RING_SIZE) {
+        s->out_tail = s->out_head - OUTPUT_RING_SIZE;  // Scrollback overflow
+    }
+    stats_observe(&stats.pty_read_bytes, n);
+    s->stats.pty_reads++;
+}
+
+// Pty is readable: drain shell output into the ring until it is full or
+// the pty is empty. A detached session overwrites its oldest output
+// instead of stalling the shell. Returns SESSION_CLOSE once the shell has
+// gone away.
+static int session_read_pty(reactor_t *r, session_t *s) {
+    struct iovec iov[2];
+    size_t budget = OUTPUT_RING_SIZE;  // Bound one pass for a shell that never stops writing
+
+    while (budget > 0 && (s->detached || s->out_head - s->out_tail < OUTPUT_RING_SIZE)) {
+        size_t space = s->detached ? budget : OUTPUT_RING_SIZE - (s->out_head - s->out_tail);
+        int cnt = ring_iov(s->out_ring, s->out_head, space, iov);
+
+        ssize_t bytes_read = readv(s->master_fd, iov, cnt);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (bytes_read <= 0) {
+            syslog(LOG_INFO, "Shell exited for %s:%d channel %d", s->client_ip, s->client_port, s->channel);
+            return SESSION_CLOSE;
+        }
+        session_add_output(s, bytes_read);
+        budget -= bytes_read < (ssize_t)budget ? bytes_read : budget;
+    }
+    return 0;
+}
+
+// Ready ptys of a batch of events, when transfers go through io_uring.
+// Reads go out in rounds, one read per pty straight into its ring and one
+// io_uring_enter() per round; ptys that had output are read again until
+// they run dry or hit session_read_pty()'s budget. The pty handlers take
+// the outcome with session_finish_read().
+static void reactor_read_ptys(reactor_t *r, struct epoll_event *events, int n) {
+    session_t *reading[MAX_EVENTS];
+    size_t budget[MAX_EVENTS];
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        ev_tag_t *tag = events[i].data.ptr;
+        if (tag != NULL && tag->kind == EV_PTY && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            tag->session->read_queued = 1;
+            tag->session->read_rc = 0;
+            budget[count] = OUTPUT_RING_SIZE;
+            reading[count++] = tag->session;
+        }
+    }
+
+    while (count > 0) {
+        int queued = 0;
+        for (int i = 0; i < count; i++) {
+            session_t *s = reading[i];
+            if (!s->detached && s->out_head - s->out_tail >= OUTPUT_RING_SIZE) {
+                continue;
+            }
+            size_t space = s->detached ? budget[i] : OUTPUT_RING_SIZE - (s->out_head - s->out_tail);
+            size_t off = s->out_head & (OUTPUT_RING_SIZE - 1);
+            if (space > OUTPUT_RING_SIZE - off) {
+                space = OUTPUT_RING_SIZE - off;  // Up to the end of the ring; the next round wraps
+            }
+            if (uring_read(r->uring_io, s->master_fd, s->out_ring + off, space, s->ring_buf, &s->read_res) < 0) {
+                break;  // The rest wait for the next wakeup
+            }
+            budget[queued] = budget[i];
+            reading[queued++] = s;
+        }
+        uring_transfer(r->uring_io);
+
+        count = 0;
+        for (int i = 0; i < queued; i++) {
+            session_t *s = reading[i];
+            ssize_t got = s->read_res;
+            if (got == -EAGAIN || got == -EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                s->read_rc = SESSION_CLOSE;
+                continue;
+            }
+            session_add_output(s, got);
+            if ((size_t)got < budget[i]) {
+                budget[count] = budget[i] - got;
+                reading[count++] = s;
+            }
+        }
+    }
+}
+
+// Outcome of the reads reactor_read_ptys() did for a session
+static int session_finish_read(session_t *s) {
+    s->read_queued = 0;
+    if (s->read_rc < 0) {
+        syslog(LOG_INFO, "Shell exited for %s:%d channel %d", s->client_ip, s->client_port, s->channel);
+    }
+    return s->read_rc;
+}
+
+// Tell a waiting client where it stands. Returns -1 if it has gone.
+static int queue_notify(int fd, int position) {
+    char frame[PROTO_HDR_SIZE + 16];
+
+    int len = snprintf(frame + PROTO_HDR_SIZE, sizeof(frame) - PROTO_HDR_SIZE, "%d", position);
+    proto_encode_header((unsigned char *)frame, MSG_QUEUE, 0, len);
+    return send(fd, frame, PROTO_HDR_SIZE + len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 ? -1 : 0;
+}
+
+// Whether a waiting client has hung up
+static int waiting_gone(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
+
+// Drop waiting clients that hung up, so they neither hold a place in the
+// queue nor count against its length. The rest are told their new
+// position when anyone ahead of them left; admitted is how many were
+// just taken from the front.
+static void queue_prune(reactor_t *r, int admitted) {
+    int kept = 0;
+
+    for (int i = 0; i < r->queue_count; i++) {
+        waiting_t *w = &r->waiting[(r->queue_head + i) % r->queue_max];
+        if (waiting_gone(w->fd) || ((admitted > 0 || kept != i) && queue_notify(w->fd, kept + 1) < 0)) {
+            syslog(LOG_INFO, "Client %s:%d left the admission queue", w->ip, w->port);
+            STATS_ADD(admission_abandoned, 1);
+            close(w->fd);
+            continue;
+        }
+        r->waiting[(r->queue_head + kept) % r->queue_max] = *w;
+        kept++;
+    }
+    r->queue_count = kept;
+    r->queue_check_at = now_ms() + QUEUE_POLL_MS;
+}
+
+// Give freed session slots to waiting connections, first come first
+// served, and tell the ones still waiting how far they have moved up.
+// Without a slot to give, the queue is still checked for hangups now
+// and then.
+static void reactor_admit(reactor_t *r) {
+    int admitted = 0;
+
+    while (r->queue_count > 0 && r->session_count < r->max_sessions) {
+        waiting_t *w = &r->waiting[r->queue_head];
+        r->queue_head = (r->queue_head + 1) % r->queue_max;
+        r->queue_count--;
+        admitted++;
+
+        // Skip clients that gave up while they waited
+        if (waiting_gone(w->fd)) {
+            STATS_ADD(admission_abandoned, 1);
+            close(w->fd);
+        } else if (conn_open(r, w->fd, w->ip, w->port) == NULL) {
+            close(w->fd);
+        }
+    }
+    if (admitted > 0 || (r->queue_count > 0 && now_ms() >= r->queue_check_at)) {
+        queue_prune(r, admitted);
+    }
+}
+
+// A new client: give it a session. Past the session cap it queues for a
+// slot behind anyone already waiting instead of being dropped; only a
+// full queue refuses it.
+static void reactor_add_client(reactor_t *r, int client_socket, const char *ip, int port) {
+    syslog(LOG_INFO, "Client connected: %s:%d", ip, port);
+
+    if (r->session_count >= r->max_sessions || r->queue_count > 0) {
+        if (r->queue_count == r->queue_max) {
+            queue_prune(r, 0);  // Only live clients count against the limit
+        }
+        if (r->queue_count == r->queue_max || queue_notify(client_socket, r->queue_count + 1) < 0) {
+            syslog(LOG_WARNING, "Maximum sessions reached and admission queue full, rejecting client.");
+            STATS_ADD(admission_rejected, 1);
+            close(client_socket);
+            return;
+        }
+        waiting_t *w = &r->waiting[(r->queue_head + r->queue_count) % r->queue_max];
+        w->fd = client_socket;
+        strcpy(w->ip, ip);
+        w->port = port;
+        r->queue_count++;
+        STATS_ADD(admission_queued, 1);
+        return;
+    }
+
+    if (conn_open(r, client_socket, ip, port) == NULL) {
+        close(client_socket);
+    }
+}
+
+// Accept every pending connection on one of the reactor's listening sockets
+static void reactor_accept(reactor_t *r, int listen_fd) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+
+    while (1) {
+        client_addr_len = sizeof(client_addr);
+        int client_socket = accept(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                syslog(LOG_ERR, "Accept failed with error: %d", errno);
+            }
+            return;
+        }
+
+        set_nonblocking(client_socket);
+        fcntl(client_socket, F_SETFD, FD_CLOEXEC);
+        if (client_addr.ss_family == AF_UNIX) {
+            // Only yashd's own user (or root) may use the local socket
+            struct ucred cred;
+            socklen_t cred_len = sizeof(cred);
+            if (getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+                syslog(LOG_WARNING, "Refused local client: SO_PEERCRED failed: %s", strerror(errno));
+                close(client_socket);
+                continue;
+            }
+            if (cred.uid != geteuid() && cred.uid != 0) {
+                syslog(LOG_WARNING, "Refused local client with uid %d", (int)cred.uid);
+                close(client_socket);
+                continue;
+            }
+            strcpy(ip, "local");
+            port = cred.pid;
+        } else {
+            struct sockaddr_in *in = (struct sockaddr_in *)&client_addr;
+            inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+            port = ntohs(in->sin_port);
+            int nodelay = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+
+        reactor_add_client(r, client_socket, ip, port);
+    }
+}
+
+// Take the connections the accept threads have queued
+static void reactor_take_accepted(reactor_t *r) {
+    accepted_t batch[MAX_EVENTS];
+    char ip[INET_ADDRSTRLEN];
+    int n;
+
+    do {
+        n = acceptor_take(batch, MAX_EVENTS);
+        for (int i = 0; i < n; i++) {
+            inet_ntop(AF_INET, &batch[i].addr.sin_addr, ip, sizeof(ip));
+            reactor_add_client(r, batch[i].fd, ip, ntohs(batch[i].addr.sin_port));
+        }
+    } while (n == MAX_EVENTS);
+}
+
+// Admin socket: dump every counter to each connecting client and hang up
+static void reactor_admin(reactor_t *r) {
+    size_t len, off;
+
+    while (1) {
+        int fd = accept4(r->admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        char *buf = render_stats(r, NULL, &len);
+        if (buf != NULL) {
+            // Small, local and short-lived: a blocking write with a timeout is enough
+            struct timeval tv = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            off = PROTO_HDR_SIZE;
+            while (off < len) {
+                ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    break;
+                }
+                off += n;
+            }
+            free(buf);
+        }
+        close(fd);
+    }
+}
+
+// Owner-only Unix socket listening at path; what names it in the log. A
+// socket of ours left at path by an earlier run is replaced, but anything
+// else there (a file, a link, someone else's socket in /tmp) makes the
+// setup fail rather than be unlinked.
+static int open_unix_listener(const char *path, int backlog, const char *what) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "%s socket path too long", what);
+        return -1;
+    }
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            syslog(LOG_ERR, "%s socket path %s is taken by something else", what, path);
+            return -1;
+        }
+        unlink(path);
+    } else if (errno != ENOENT) {
+        syslog(LOG_ERR, "%s socket path %s: %s", what, path, strerror(errno));
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    mode_t old_mask = umask(077);  // Owner only
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc < 0 || listen(fd, backlog) < 0) {
+        syslog(LOG_ERR, "%s socket setup failed", what);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// yashd's only child is the spawner; without it no new shell can start
+static void reap_children() {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        syslog(LOG_ERR, "Shell spawner %d exited", pid);
+    }
+}
+
+// Raise the descriptor limit so the reactor can hold thousands of sessions
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// The shell behind a session is gone. Send its last words and tell the
+// client; a connection whose last shell exited is closed with it.
+static void reactor_shell_exited(reactor_t *r, session_t *s) {
+    conn_t *c = s->conn;
+    int lost = (c != NULL && conn_flush(r, c) < 0);
+
+    session_close(r, s);
+    if (c == NULL) {
+        return;
+    }
+    // Frames held back for room in that shell can be taken now
+    if (c->stalled && conn_handle_frames(r, c) < 0) {
+        conn_close(r, c, 0);
+        return;
+    }
+    if (!lost && c->channels == NULL) {
+        conn_flush(r, c);  // Best effort for the MSG_CLOSE
+        conn_close(r, c, 0);
+    } else if (lost || conn_flush(r, c) < 0) {
+        conn_close(r, c, 1);
+    }
+}
+
+static void reactor_run(reactor_t *r) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int timeout = -1;
+        if (r->detached_count > 0) {
+            timeout = DETACH_POLL_MS;
+        }
+        if (r->queue_count > 0 && (timeout < 0 || QUEUE_POLL_MS < timeout)) {
+            timeout = QUEUE_POLL_MS;
+        }
+        if (r->corked_count > 0 && (timeout < 0 || r->cork_ms < timeout)) {
+            timeout = r->cork_ms;
+        }
+        int n = reactor_wait(r, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "%s wait error", r->uring != NULL ? "io_uring" : "epoll");
+            break;
+        }
+        STATS_ADD(epoll_wakeups, 1);
+        if (r->uring_io != NULL) {
+            reactor_read_ptys(r, events, n);
+        }
+
+        for (int i = 0; i < n; i++) {
+            ev_tag_t *tag = events[i].data.ptr;
+            if (tag == NULL) {
+                continue;
+            }
+            // Whatever a handler tears down is dropped from the rest of the batch
+            r->batch = events + i + 1;
+            r->batch_left = n - i - 1;
+            int rc = 0;
+
+            if (tag->kind == EV_LISTEN) {
+                reactor_accept(r, r->listen_fd[tag - r->listen_ev]);
+            } else if (tag->kind == EV_ACCEPTED) {
+                reactor_take_accepted(r);
+            } else if (tag->kind == EV_ADMIN) {
+                reactor_admin(r);
+            } else if (tag->kind == EV_SOCKET) {
+                conn_t *c = tag->conn;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    rc = conn_read_socket(r, c);
+                }
+                if (rc == 0 && (events[i].events & EPOLLOUT)) {
+                    rc = conn_want_flush(r, c);
+                }
+                if (rc < 0) {
+                    // Detach the shells of a client that vanished, close the rest
+                    conn_close(r, c, rc == SESSION_DETACH);
+                }
+            } else if (tag->kind == EV_PTY) {
+                session_t *s = tag->session;
+                if (events[i].events & EPOLLOUT) {
+                    rc = session_flush_input(s);
+                }
+                if (rc == 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    rc = s->read_queued ? session_finish_read(s) : session_read_pty(r, s);
+                }
+                conn_t *c = s->conn;
+                if (rc < 0) {
+                    reactor_shell_exited(r, s);
+                } else if (c == NULL) {
+                    session_update_pty(r, s);
+                } else if (conn_want_flush(r, c) < 0) {
+                    conn_close(r, c, 1);
+                } else if (c->stalled && (rc = conn_handle_frames(r, c)) < 0) {
+                    conn_close(r, c, 0);  // The frames held back were bad or a quit
+                }
+            } else if (tag->kind == EV_PIPE) {
+                session_t *s = tag->session;
+                conn_t *c = s->conn;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    session_close_pipe(r, s);  // The command closed its stdin
+                } else {
+                    session_flush_data(r, s);
+                }
+                session_update_events(r, s);
+                if (c != NULL && c->stalled && conn_handle_frames(r, c) < 0) {
+                    conn_close(r, c, 0);
+                }
+            }
+        }
+        r->batch_left = 0;
+        reactor_write_batch(r);
+
+        // Give up on detached sessions whose client did not come back
+        if (r->detached_count > 0) {
+            long long now = now_ms();
+            session_t *next;
+            for (session_t *s = r->sessions; s != NULL; s = next) {
+                next = s->next;
+                if (s->detached && now >= s->detach_until) {
+                    syslog(LOG_INFO, "Detached session %s:%d expired", s->client_ip, s->client_port);
+                    session_close(r, s);
+                }
+            }
+        }
+
+        reactor_admit(r);
+
+        // Uncork connections whose flush timer ran out
+        if (r->corked_count > 0) {
+            long long now = now_ms();
+            for (session_t *s = r->sessions; s != NULL; s = s->next) {
+                if (s->conn != NULL && s->conn->corked && now >= s->conn->uncork_at) {
+                    conn_uncork(r, s->conn);
+                }
+            }
+        }
+
+        reap_children();
+    }
+}
+
+
+
+// A listening socket on the server port. Shared ones are bound with
+// SO_REUSEPORT for the accept threads and left blocking for their accept().
+static int open_listener(int shared) {
+    struct sockaddr_in server_addr;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Enable port reuse
+    int reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0 ||
+        (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0)) {
+        perror("setsockopt(SO_REUSEADDR/SO_REUSEPORT) failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind the socket to the specified port
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    server_addr.sin_addr.s_addr = INADDR_ANY;  // Bind to any address
+
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        syslog(LOG_ERR, "Bind failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Listen for incoming connections
+    if (listen(fd, SOMAXCONN) < 0) {
+        syslog(LOG_ERR, "Listen failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    if (!shared) {
+        set_nonblocking(fd);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+// acceptor_listen_fn for the accept threads
+static int open_shared_listener(void) {
+    return open_listener(1);
+}
+
+void run_server(const server_config_t *cfg) {
+    reactor_t reactor;
+    reactor_t *r = &reactor;
+
+    memset(r, 0, sizeof(*r));
+    r->grace_ms = (long long)cfg->grace_sec * 1000;
+    r->cork_bytes = cfg->cork_bytes > 0 ? cfg->cork_bytes : 0;
+    r->cork_ms = cfg->cork_ms > 0 ? cfg->cork_ms : 1;
+    raise_fd_limit();
+
+    // Shells report into shared stats and are forked by the spawner, both
+    // set up before the first thread exists
+    if (stats_share() < 0) {
+        syslog(LOG_WARNING, "No shared memory for command launch stats");
+    }
+    spawner_start();
+
+    // Start the command log writer (appends to the log file)
+    if (logger_start("/tmp/yashd.log") < 0) {
+        syslog(LOG_ERR, "Failed to open log file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Open the listening sockets. With accept threads, each has a socket
+    // of its own on the port and the kernel spreads connections over them;
+    // the reactor only takes what they accepted.
+    r->accept_fd = -1;
+    if (cfg->acceptors > 0) {
+        r->accept_fd = acceptor_start(cfg->acceptors, open_shared_listener);
+        if (r->accept_fd < 0) {
+            syslog(LOG_ERR, "Failed to start accept threads");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        r->listen_fd[r->listen_count++] = open_listener(0);
+    }
+    // Clients on this host can skip the TCP stack. Accepted ones are
+    // checked with SO_PEERCRED.
+    int local_fd = cfg->local_path[0] != '\0' ? open_unix_listener(cfg->local_path, SOMAXCONN, "Local") : -1;
+    if (local_fd >= 0) {
+        r->listen_fd[r->listen_count++] = local_fd;
+    }
+
+    r->max_sessions = cfg->max_sessions;
+    r->queue_max = cfg->queue_len;
+    r->waiting = calloc(r->queue_max > 0 ? r->queue_max : 1, sizeof(waiting_t));
+    if (r->waiting == NULL) {
+        syslog(LOG_ERR, "Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd < 0) {
+        syslog(LOG_ERR, "epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    if (cfg->use_uring) {
+        r->uring = uring_open(URING_DEFAULT_ENTRIES);
+        r->uring_io = r->uring != NULL ? uring_open(URING_DEFAULT_ENTRIES) : NULL;
+        if (r->uring == NULL || r->uring_io == NULL) {
+            syslog(LOG_WARNING, "io_uring unavailable, using epoll");
+            uring_close(r->uring);
+            uring_close(r->uring_io);
+            r->uring = r->uring_io = NULL;
+        } else if (uring_buffers(r->uring_io, r->max_sessions) < 0) {
+            syslog(LOG_WARNING, "io_uring cannot register buffers, transfers go unregistered");
+        }
+    }
+
+    // Pre-start shells for the first connections
+    if (pool_start(cfg->pool_size, spawn_session_shell) < 0) {
+        syslog(LOG_ERR, "Failed to start session pool");
+    }
+
+    for (int i = 0; i < r->listen_count; i++) {
+        r->listen_ev[i].kind = EV_LISTEN;
+        r->listen_ev[i].session = NULL;
+        reactor_ctl(r, EPOLL_CTL_ADD, r->listen_fd[i], &r->listen_ev[i], EPOLLIN);
+    }
+    if (r->accept_fd >= 0) {
+        r->accept_ev.kind = EV_ACCEPTED;
+        r->accept_ev.session = NULL;
+        reactor_ctl(r, EPOLL_CTL_ADD, r->accept_fd, &r->accept_ev, EPOLLIN);
+    }
+
+    r->admin_fd = open_unix_listener(cfg->stats_path, 16, "Stats");  // Failure only disables the stats dump
+    if (r->admin_fd >= 0) {
+        r->admin_ev.kind = EV_ADMIN;
+        r->admin_ev.session = NULL;
+        reactor_ctl(r, EPOLL_CTL_ADD, r->admin_fd, &r->admin_ev, EPOLLIN);
+    }
+
+    syslog(LOG_INFO, "Server listening on port %d", PORT);
+    printf("Server listening on port %d", PORT);
+    fflush(stdout);
+
+    reactor_run(r);
+
+    acceptor_stop();
+    pool_stop();
+
+    // Close the server socket when shutting down
+    if (r->admin_fd >= 0) {
+        close(r->admin_fd);
+        unlink(cfg->stats_path);
+    }
+    if (local_fd >= 0) {
+        unlink(cfg->local_path);
+    }
+    uring_close(r->uring);
+    uring_close(r->uring_io);
+    close(r->epoll_fd);
+    for (int i = 0; i < r->listen_count; i++) {
+        close(r->listen_fd[i]);
+    }
+    for (int i = 0; i < r->queue_count; i++) {
+        close(r->waiting[(r->queue_head + i) % r->queue_max].fd);
+    }
+    free(r->waiting);
+    logger_stop();
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p pool_size] [-s stats_socket] [-U local_socket] [-g grace_seconds] [-u]\n"
+            "       [-c cork_bytes] [-t cork_ms] [-l cpu=sec,as=mb,nofile=n,nproc=n]\n"
+            "       [-a acceptors] [-m max_sessions] [-q queue_length]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    server_config_t cfg = {
+        .pool_size = POOL_DEFAULT_SIZE,
+        .stats_path = STATS_SOCKET_PATH,
+        .local_path = LOCAL_SOCKET_PATH,
+        .grace_sec = DETACH_GRACE_SEC,
+        .cork_bytes = CORK_DEFAULT_BYTES,
+        .cork_ms = CORK_DEFAULT_MS,
+        .acceptors = 0,
+        .max_sessions = MAX_SESSIONS,
+        .queue_len = ADMIT_QUEUE_DEFAULT,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:U:g:uc:t:l:a:m:q:")) != -1) {
+        switch (opt) {
+        case 'p':
+            cfg.pool_size = atoi(optarg);  // 0 disables the warm pool
+            break;
+        case 's':
+            cfg.stats_path = optarg;
+            break;
+        case 'U':
+            cfg.local_path = optarg;  // "" leaves TCP as the only transport
+            break;
+        case 'g':
+            cfg.grace_sec = atoi(optarg);  // 0 ends sessions when their client disconnects
+            break;
+        case 'u':
+            cfg.use_uring = 1;  // Falls back to epoll if io_uring cannot be set up
+            break;
+        case 'c':
+            cfg.cork_bytes = atoi(optarg);  // 0 keeps every connection on TCP_NODELAY alone
+            break;
+        case 't':
+            cfg.cork_ms = atoi(optarg);
+            break;
+        case 'l':
+            if (parse_session_limits(optarg) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            cfg.acceptors = atoi(optarg);  // 0 keeps accepting on the reactor
+            if (cfg.acceptors < 0 || cfg.acceptors > ACCEPTOR_MAX) {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            cfg.max_sessions = atoi(optarg);
+            if (cfg.max_sessions < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            cfg.queue_len = atoi(optarg);  // 0 refuses everything past the cap
+            if (cfg.queue_len < 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    //create_daemon();
+    run_server(&cfg);  // Start the server
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,122 @@
+// stats.c: Histograms and text exposition of yashd counters
+
+#include "stats.h"
+#include <sys/mman.h>
+
+static const unsigned long latency_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+static const unsigned long size_bounds[] = {
+    1, 4, 16, 64, 256, 512, 1024, 2048, 4096, 16384, 65536, 262144
+};
+
+server_stats_t stats = {
+    .shell_spawn_us = { "yashd_shell_spawn_us", "Time to get a new session shell from the spawner, microseconds",
+                        latency_bounds, STATS_HIST_BUCKETS },
+    .pty_read_bytes = { "yashd_pty_read_bytes", "Bytes returned by each pty read",
+                        size_bounds, STATS_HIST_BUCKETS },
+};
+
+// Put the histograms that session shells update in memory they share with
+// the server. Must run before the first shell is forked.
+int stats_share() {
+    stats_hist_t *h = mmap(NULL, 2 * sizeof(*h), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED) {
+        return -1;
+    }
+    h[0].name = "yashd_launch_us";
+    h[0].help = "Time for a session shell to fork or spawn a command, microseconds";
+    h[1].name = "yashd_command_us";
+    h[1].help = "Time for a session shell to run a command line to completion, microseconds";
+    for (int i = 0; i < 2; i++) {
+        h[i].bounds = latency_bounds;
+        h[i].nbounds = STATS_HIST_BUCKETS;
+    }
+    stats.launch_us = &h[0];
+    stats.command_us = &h[1];
+    return 0;
+}
+
+void stats_observe(stats_hist_t *h, unsigned long value) {
+    int i = 0;
+    while (i < h->nbounds && value > h->bounds[i]) {
+        i++;
+    }
+    atomic_fetch_add_explicit(&h->counts[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+void stats_format_counter(FILE *fp, const char *name, const char *type, const char *help, unsigned long value) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+static void format_hist(FILE *fp, stats_hist_t *h) {
+    unsigned long cumulative = 0;
+
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+    for (int i = 0; i < h->nbounds; i++) {
+        cumulative += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        fprintf(fp, "%s_bucket{le=\"%lu\"} %lu\n", h->name, h->bounds[i], cumulative);
+    }
+    cumulative += atomic_load_explicit(&h->counts[h->nbounds], memory_order_relaxed);
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n", h->name, cumulative);
+    fprintf(fp, "%s_sum %lu\n", h->name, atomic_load_explicit(&h->sum, memory_order_relaxed));
+    fprintf(fp, "%s_count %lu\n", h->name, atomic_load_explicit(&h->count, memory_order_relaxed));
+}
+
+// Server-wide counters and histograms
+void stats_format(FILE *fp) {
+    stats_format_counter(fp, "yashd_sessions_active", "gauge", "Open sessions",
+                         (unsigned long)atomic_load(&stats.sessions_active));
+    stats_format_counter(fp, "yashd_sessions_total", "counter", "Sessions opened since start",
+                         atomic_load(&stats.sessions_total));
+    stats_format_counter(fp, "yashd_connections_active", "gauge", "Open client connections",
+                         (unsigned long)atomic_load(&stats.connections_active));
+    stats_format_counter(fp, "yashd_bytes_in_total", "counter", "Bytes received from clients",
+                         atomic_load(&stats.bytes_in));
+    stats_format_counter(fp, "yashd_bytes_out_total", "counter", "Bytes sent to clients",
+                         atomic_load(&stats.bytes_out));
+    stats_format_counter(fp, "yashd_commands_total", "counter", "Command frames received",
+                         atomic_load(&stats.commands));
+    stats_format_counter(fp, "yashd_epoll_wakeups_total", "counter", "Returns from epoll_wait()",
+                         atomic_load(&stats.epoll_wakeups));
+    stats_format_counter(fp, "yashd_detaches_total", "counter", "Sessions detached from a lost client",
+                         atomic_load(&stats.detaches));
+    stats_format_counter(fp, "yashd_reattaches_total", "counter", "Detached sessions picked up again",
+                         atomic_load(&stats.reattaches));
+    stats_format_counter(fp, "yashd_zlib_in_bytes_total", "counter", "Output bytes compressed",
+                         atomic_load(&stats.zlib_in));
+    stats_format_counter(fp, "yashd_zlib_out_bytes_total", "counter", "Compressed output bytes",
+                         atomic_load(&stats.zlib_out));
+    stats_format_counter(fp, "yashd_tcp_corks_total", "counter", "Times bulk output corked a connection",
+                         atomic_load(&stats.tcp_corks));
+    stats_format_counter(fp, "yashd_tcp_cork_flushes_total", "counter", "Corked output pushed by the flush timer",
+                         atomic_load(&stats.tcp_cork_flushes));
+    stats_format_counter(fp, "yashd_coalesced_bytes_total", "counter", "Bytes sent while corked",
+                         atomic_load(&stats.coalesced_bytes));
+    stats_format_counter(fp, "yashd_admission_queued_total", "counter", "Connections queued for a session",
+                         atomic_load(&stats.admission_queued));
+    stats_format_counter(fp, "yashd_admission_rejected_total", "counter", "Connections refused with the queue full",
+                         atomic_load(&stats.admission_rejected));
+    stats_format_counter(fp, "yashd_admission_abandoned_total", "counter", "Queued connections that hung up",
+                         atomic_load(&stats.admission_abandoned));
+    format_hist(fp, &stats.shell_spawn_us);
+    if (stats.launch_us != NULL) {
+        format_hist(fp, stats.launch_us);
+        format_hist(fp, stats.command_us);
+    }
+    format_hist(fp, &stats.pty_read_bytes);
+}
+
+// One session's counters, labelled with its client address
+void stats_format_session(FILE *fp, const char *label, const session_stats_t *ss, long long now_ms) {
+    fprintf(fp, "yashd_session_bytes_in{session=\"%s\"} %lu\n", label, ss->bytes_in);
+    fprintf(fp, "yashd_session_bytes_out{session=\"%s\"} %lu\n", label, ss->bytes_out);
+    fprintf(fp, "yashd_session_commands{session=\"%s\"} %lu\n", label, ss->commands);
+    fprintf(fp, "yashd_session_pty_reads{session=\"%s\"} %lu\n", label, ss->pty_reads);
+    fprintf(fp, "yashd_session_age_ms{session=\"%s\"} %lld\n", label, now_ms - ss->opened_ms);
+    if (ss->zlib_out > 0) {
+        fprintf(fp, "yashd_session_zlib_ratio{session=\"%s\"} %.2f\n", label, (double)ss->zlib_in / ss->zlib_out);
+    }
+}
@@ -0,0 +1,74 @@
+// stats.h: Server and per-session counters for yashd
+//
+// Server-wide counters are atomics because the pool's refill thread updates
+// them alongside the reactor. Per-session counters live in the session and
+// are only touched by the reactor thread. stats_format() renders both in a
+// plain text exposition format: one "name{labels} value" sample per line.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define STATS_HIST_BUCKETS 12   // Finite buckets; an implicit +Inf follows
+
+// Cumulative histogram with fixed upper bounds
+typedef struct {
+    const char *name;
+    const char *help;
+    const unsigned long *bounds;
+    int nbounds;
+    atomic_ulong counts[STATS_HIST_BUCKETS + 1];
+    atomic_ulong sum;
+    atomic_ulong count;
+} stats_hist_t;
+
+typedef struct {
+    atomic_long sessions_active;
+    atomic_ulong sessions_total;
+    atomic_long connections_active;  // Client sockets; each carries one or more sessions
+    atomic_ulong bytes_in;        // Socket bytes read from clients
+    atomic_ulong bytes_out;       // Socket bytes written to clients
+    atomic_ulong commands;
+    atomic_ulong epoll_wakeups;
+    atomic_ulong detaches;        // Sessions kept alive after their client vanished
+    atomic_ulong reattaches;
+    atomic_ulong zlib_in;         // Output bytes fed to compression
+    atomic_ulong zlib_out;        // Compressed bytes produced
+    atomic_ulong tcp_corks;       // Connections switched to corked sends for bulk output
+    atomic_ulong tcp_cork_flushes;  // Flush timer expiries that took the cork off
+    atomic_ulong coalesced_bytes; // Socket bytes written while corked
+    atomic_ulong admission_queued;    // Connections that had to wait for a session slot
+    atomic_ulong admission_rejected;  // Connections refused with the wait queue full
+    atomic_ulong admission_abandoned; // Queued connections that hung up before a slot freed
+    stats_hist_t shell_spawn_us;  // Spawner round trip for a new session shell
+    // Updated by the session shells, in memory shared with them; NULL
+    // until stats_share()
+    stats_hist_t *launch_us;      // Starting one command
+    stats_hist_t *command_us;     // Running one command line to completion
+    stats_hist_t pty_read_bytes;  // Size of each read from a pty
+} server_stats_t;
+
+// Counters for one session; owned by the reactor thread
+typedef struct {
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long commands;
+    unsigned long pty_reads;
+    unsigned long zlib_in;
+    unsigned long zlib_out;
+    long long opened_ms;
+} session_stats_t;
+
+extern server_stats_t stats;
+
+#define STATS_ADD(field, n) atomic_fetch_add_explicit(&stats.field, (n), memory_order_relaxed)
+
+int stats_share();
+void stats_observe(stats_hist_t *h, unsigned long value);
+void stats_format_counter(FILE *fp, const char *name, const char *type, const char *help, unsigned long value);
+void stats_format(FILE *fp);
+void stats_format_session(FILE *fp, const char *label, const session_stats_t *ss, long long now_ms);
+
+#endif
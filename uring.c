@@ -0,0 +1,648 @@
+// uring.c: io_uring backend: poll-based waits with batched interest
+// changes, and batched reads and writes into registered buffers
+//
+// Talks to the kernel through the raw io_uring_setup()/io_uring_enter()
+// syscalls and the mmap()ed rings, so no liburing is needed.
+
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// One read or write request of a transfer, and how it ended
+typedef struct {
+    size_t len;
+    int res;
+    int done;
+} xfer_op_t;
+
+// A read()- or writev()-like transfer: one request per iovec, linked so
+// the next only runs once the one before moved all its bytes
+typedef struct {
+    ssize_t *res;
+    int first;         // Its first request in ops
+    int count;
+} xfer_t;
+
+// One fd being watched. Its slot index and generation form the user_data
+// of the poll request, so a completion that arrives after the watch was
+// dropped (or its slot reused) is recognised and ignored.
+typedef struct {
+    void *tag;         // NULL while the slot is free
+    int fd;
+    uint32_t want;     // Interest set asked for by the reactor
+    uint32_t armed;    // Mask of the poll request in flight, 0 if none
+    uint32_t gen;
+    int queued;        // Already on the arm list
+} watch_t;
+
+struct uring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    unsigned sqes_count;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    watch_t *watch;
+    int watch_cap;
+    int *free_slots;   // Stack of unused slot indexes
+    int free_count;
+    int *arm;          // Watches to (re)arm before the next wait
+    int arm_count;
+    int poll_update;   // Kernel can change a poll's mask in place (5.13+)
+
+    xfer_op_t *ops;    // Requests queued for uring_transfer(), one per entry
+    int op_count;
+    xfer_t *xfers;
+    int xfer_count;
+    struct iovec *bufs;  // Registered buffers by index; iov_base NULL while free
+    int *free_bufs;      // Stack of unused buffer indexes
+    int free_buf_count;
+};
+
+// Completions of removals and updates carry this and are skipped
+#define URING_IGNORE 0
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static uint64_t watch_data(uring_t *u, int slot) {
+    return ((uint64_t)u->watch[slot].gen << 32) | (uint32_t)(slot + 1);
+}
+
+static unsigned uring_unsubmitted(uring_t *u) {
+    return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Next free submission entry, handing the queued ones to the kernel first
+// if the ring is full
+static struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+    if (uring_unsubmitted(u) >= u->sq_entries) {
+        uring_enter(u->fd, uring_unsubmitted(u), 0, 0, NULL, 0);
+        if (uring_unsubmitted(u) >= u->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void watch_queue(uring_t *u, int slot) {
+    watch_t *w = &u->watch[slot];
+    if (!w->queued) {
+        w->queued = 1;
+        u->arm[u->arm_count++] = slot;
+    }
+}
+
+// Queue a one-shot poll for the watch's current interest set
+static void watch_arm(uring_t *u, int slot) {
+    watch_t *w = &u->watch[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (sqe == NULL) {
+        return;  // Stays unarmed until the reactor changes its interest
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->fd;
+    sqe->poll32_events = w->want;
+    sqe->user_data = watch_data(u, slot);
+    w->armed = w->want;
+}
+
+// Queue a change of the poll in flight to the update mask, in place when
+// the kernel can do that. Otherwise (or for update == 0) the poll is
+// removed and a new generation orphans its completion, so a fresh poll
+// armed for the watch later can never run alongside the old one.
+static void watch_disarm(uring_t *u, int slot, uint32_t update) {
+    watch_t *w = &u->watch[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = watch_data(u, slot);
+    sqe->user_data = URING_IGNORE;
+    if (update != 0 && u->poll_update) {
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+        sqe->poll32_events = update;
+        w->armed = update;
+        return;
+    }
+    w->gen++;
+    w->armed = 0;
+    if (update != 0) {
+        watch_queue(u, slot);
+    }
+}
+
+// Whether POLL_REMOVE takes IORING_POLL_UPDATE_EVENTS. Kernels without it
+// reject the flag with EINVAL; with it, an update of a poll that does not
+// exist fails with ENOENT.
+static int uring_probe_update(uring_t *u) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = URING_IGNORE;
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = EPOLLIN;
+    sqe->user_data = URING_IGNORE;
+    if (uring_enter(u->fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        return 0;
+    }
+
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    int res = u->cqes[head & u->cq_mask].res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res != -EINVAL;
+}
+
+static int watch_alloc(uring_t *u) {
+    if (u->free_count == 0) {
+        int cap = u->watch_cap ? 2 * u->watch_cap : 64;
+        watch_t *watch = realloc(u->watch, cap * sizeof(watch_t));
+        int *free_slots = realloc(u->free_slots, cap * sizeof(int));
+        int *arm = realloc(u->arm, cap * sizeof(int));
+        if (watch != NULL) {
+            u->watch = watch;
+        }
+        if (free_slots != NULL) {
+            u->free_slots = free_slots;
+        }
+        if (arm != NULL) {
+            u->arm = arm;
+        }
+        if (watch == NULL || free_slots == NULL || arm == NULL) {
+            return -1;
+        }
+        memset(u->watch + u->watch_cap, 0, (cap - u->watch_cap) * sizeof(watch_t));
+        for (int i = cap - 1; i >= u->watch_cap; i--) {
+            u->free_slots[u->free_count++] = i;
+        }
+        u->watch_cap = cap;
+    }
+    return u->free_slots[--u->free_count];
+}
+
+uring_t *uring_open(unsigned entries) {
+    struct io_uring_params p;
+    uring_t *u = calloc(1, sizeof(uring_t));
+
+    if (u == NULL) {
+        return NULL;
+    }
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    u->fd = uring_setup(entries, &p);
+    if (u->fd < 0) {
+        free(u);
+        return NULL;
+    }
+    // Timed waits need EXT_ARG; NODROP keeps completions past a full CQ ring
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(u->fd);
+        free(u);
+        return NULL;
+    }
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size) {
+            u->sq_size = u->cq_size;
+        }
+        u->cq_size = 0;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = u->sq_ptr;
+    if (u->sq_ptr != MAP_FAILED && u->cq_size > 0) {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes_count = p.sq_entries;
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uring_close(u);
+        return NULL;
+    }
+
+    char *sq = u->sq_ptr;
+    char *cq = u->cq_ptr;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->poll_update = uring_probe_update(u);
+
+    u->ops = calloc(p.sq_entries, sizeof(xfer_op_t));
+    u->xfers = calloc(p.sq_entries, sizeof(xfer_t));
+    if (u->ops == NULL || u->xfers == NULL) {
+        uring_close(u);
+        return NULL;
+    }
+    return u;
+}
+
+void uring_close(uring_t *u) {
+    if (u == NULL) {
+        return;
+    }
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_count * sizeof(struct io_uring_sqe));
+    }
+    if (u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr) {
+        munmap(u->cq_ptr, u->cq_size);
+    }
+    if (u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED) {
+        munmap(u->sq_ptr, u->sq_size);
+    }
+    close(u->fd);
+    free(u->watch);
+    free(u->free_slots);
+    free(u->arm);
+    free(u->ops);
+    free(u->xfers);
+    free(u->bufs);
+    free(u->free_bufs);
+    free(u);
+}
+
+int uring_ctl(uring_t *u, int op, int fd, int *slot, void *tag, uint32_t events) {
+    if (op == EPOLL_CTL_ADD) {
+        int i = watch_alloc(u);
+        if (i < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        watch_t *w = &u->watch[i];
+        w->tag = tag;
+        w->fd = fd;
+        w->want = events;
+        w->armed = 0;
+        w->queued = 0;
+        *slot = i;
+        watch_queue(u, i);
+        return 0;
+    }
+
+    watch_t *w = &u->watch[*slot];
+    if (op == EPOLL_CTL_MOD) {
+        w->tag = tag;
+        w->want = events;
+        if (w->armed != 0 && w->armed != events) {
+            watch_disarm(u, *slot, events);  // Becomes a plain removal for events == 0
+        } else if (w->armed == 0) {
+            watch_queue(u, *slot);
+        }
+        return 0;
+    }
+
+    // EPOLL_CTL_DEL: the generation bump orphans any completion still due
+    if (w->armed != 0) {
+        watch_disarm(u, *slot, 0);
+    }
+    w->tag = NULL;
+    w->want = 0;
+    w->gen++;
+    u->free_slots[u->free_count++] = *slot;
+    *slot = -1;
+    return 0;
+}
+
+int uring_wait(uring_t *u, struct epoll_event *events, int max, int timeout_ms) {
+    // Re-arm whatever fired in the last batch or was added since
+    for (int i = 0; i < u->arm_count; i++) {
+        watch_t *w = &u->watch[u->arm[i]];
+        w->queued = 0;
+        if (w->tag != NULL && w->want != 0 && w->armed == 0) {
+            watch_arm(u, u->arm[i]);
+        }
+    }
+    u->arm_count = 0;
+
+    // One syscall hands over every queued change and waits for completions
+    int interrupted = 0;
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        memset(&arg, 0, sizeof(arg));
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        int rc = uring_enter(u->fd, uring_unsubmitted(u), 1,
+                             IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (rc < 0 && errno == EINTR) {
+            interrupted = 1;
+        } else if (rc < 0 && errno != ETIME) {
+            return -1;
+        }
+    } else if (uring_unsubmitted(u) > 0) {
+        uring_enter(u->fd, uring_unsubmitted(u), 0, 0, NULL, 0);
+    }
+
+    int n = 0;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        head++;
+        if (cqe->user_data == URING_IGNORE) {
+            continue;
+        }
+        int slot = (int)(uint32_t)cqe->user_data - 1;
+        uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+        if (slot < 0 || slot >= u->watch_cap) {
+            continue;
+        }
+        watch_t *w = &u->watch[slot];
+        if (w->tag == NULL || w->gen != gen) {
+            continue;  // Watch dropped after this poll was queued
+        }
+
+        // A fired or cancelled one-shot poll is re-armed on the next wait
+        w->armed = 0;
+        watch_queue(u, slot);
+        if (cqe->res > 0) {
+            uint32_t ready = (uint32_t)cqe->res & (w->want | EPOLLERR | EPOLLHUP);
+            if (ready != 0) {
+                events[n].events = ready;
+                events[n].data.ptr = w->tag;
+                n++;
+            }
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    if (n == 0 && interrupted) {
+        errno = EINTR;
+        return -1;
+    }
+    return n;
+}
+
+// Set up count registered buffer slots, all empty. Returns -1 when the
+// kernel cannot (sparse tables need 5.19); transfers then use plain
+// IORING_OP_READ/WRITE.
+int uring_buffers(uring_t *u, unsigned count) {
+    struct io_uring_rsrc_register reg;
+
+    if (count > URING_MAX_BUFFERS) {
+        count = URING_MAX_BUFFERS;
+    }
+    u->bufs = calloc(count, sizeof(struct iovec));
+    u->free_bufs = calloc(count, sizeof(int));
+    if (u->bufs == NULL || u->free_bufs == NULL) {
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uring_register(u->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) < 0) {
+        return -1;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        u->free_bufs[u->free_buf_count++] = i;
+    }
+    return 0;
+}
+
+static int buffer_update(uring_t *u, int index, void *buf, size_t len) {
+    struct io_uring_rsrc_update2 up;
+    struct iovec iov = { buf, len };
+
+    memset(&up, 0, sizeof(up));
+    up.offset = index;
+    up.data = (uint64_t)(uintptr_t)&iov;
+    up.nr = 1;
+    return uring_register(u->fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+}
+
+// Register buf so transfers within it use the _FIXED opcodes, which skip
+// pinning and mapping its pages on every request. The pages stay pinned,
+// counted against RLIMIT_MEMLOCK, until uring_buffer_remove(). Returns the
+// buffer index, or -1 when the slots or the limit ran out.
+int uring_buffer_add(uring_t *u, void *buf, size_t len) {
+    if (u->free_buf_count == 0) {
+        return -1;
+    }
+    int index = u->free_bufs[u->free_buf_count - 1];
+    if (buffer_update(u, index, buf, len) < 0) {
+        return -1;
+    }
+    u->free_buf_count--;
+    u->bufs[index].iov_base = buf;
+    u->bufs[index].iov_len = len;
+    return index;
+}
+
+void uring_buffer_remove(uring_t *u, int index) {
+    buffer_update(u, index, NULL, 0);
+    u->bufs[index].iov_base = NULL;
+    u->free_bufs[u->free_buf_count++] = index;
+}
+
+static struct io_uring_sqe *xfer_sqe(uring_t *u, int opcode, int fd, uint64_t addr, size_t len) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;  // Streams: no file position
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->user_data = u->op_count + 1;
+    u->ops[u->op_count].len = len;
+    u->ops[u->op_count].done = 0;
+    u->op_count++;
+    return sqe;
+}
+
+// Registered buffer that holds [p, p + len), or -1
+static int buffer_holding(uring_t *u, int index, const void *p, size_t len) {
+    const char *base = index >= 0 ? u->bufs[index].iov_base : NULL;
+
+    if (base == NULL || (const char *)p < base || (const char *)p + len > base + u->bufs[index].iov_len) {
+        return -1;
+    }
+    return index;
+}
+
+static void xfer_add(uring_t *u, ssize_t *res, int count) {
+    xfer_t *x = &u->xfers[u->xfer_count++];
+    x->res = res;
+    x->first = u->op_count;
+    x->count = count;
+}
+
+// Queue a read() of fd for the next uring_transfer(), which stores what
+// read() would return in *res, or -errno. A buffer inside the registered
+// buffer index (-1 for none) is read through it. Returns -1 when the
+// submission ring is full; the caller does the read itself then.
+int uring_read(uring_t *u, int fd, void *buf, size_t len, int index, ssize_t *res) {
+    if (u->op_count + 1 > (int)u->sq_entries) {
+        return -1;
+    }
+    xfer_add(u, res, 1);
+    index = buffer_holding(u, index, buf, len);
+    struct io_uring_sqe *sqe = xfer_sqe(u, index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                                        fd, (uint64_t)(uintptr_t)buf, len);
+    sqe->buf_index = index >= 0 ? index : 0;
+    return 0;
+}
+
+// Same for a writev() to a socket, one request per iovec: a WRITE_FIXED
+// for a piece of the registered buffer, a SEND for anything else, e.g. a
+// frame header. A SEND with more to follow carries MSG_MORE, so TCP holds
+// it for the rest instead of pushing a segment of its own. Either way a
+// full socket fails the request with -EAGAIN.
+int uring_write(uring_t *u, int fd, const struct iovec *iov, int cnt, int index, ssize_t *res) {
+    if (u->op_count + cnt > (int)u->sq_entries) {
+        return -1;
+    }
+    xfer_add(u, res, cnt);
+    for (int i = 0; i < cnt; i++) {
+        int fixed = buffer_holding(u, index, iov[i].iov_base, iov[i].iov_len);
+        struct io_uring_sqe *sqe = xfer_sqe(u, fixed >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_SEND,
+                                            fd, (uint64_t)(uintptr_t)iov[i].iov_base, iov[i].iov_len);
+        if (fixed >= 0) {
+            sqe->buf_index = fixed;
+            sqe->rw_flags = RWF_NOWAIT;
+        } else {
+            sqe->off = 0;
+            sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL | (i + 1 < cnt ? MSG_MORE : 0);
+        }
+        sqe->flags = (i + 1 < cnt) ? IOSQE_IO_LINK : 0;
+    }
+    return 0;
+}
+
+// Take the completions posted so far; returns how many requests are done
+static int xfer_reap(uring_t *u, int done) {
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        if (cqe->user_data >= 1 && cqe->user_data <= (uint64_t)u->op_count) {
+            u->ops[cqe->user_data - 1].res = cqe->res;
+            u->ops[cqe->user_data - 1].done = 1;
+            done++;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return done;
+}
+
+static int xfer_enter(uring_t *u, unsigned wait) {
+    int rc = uring_enter(u->fd, uring_unsubmitted(u), wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) ? -errno : 0;
+}
+
+// Submit every queued transfer in one io_uring_enter() and store their
+// results. Requests that can go ahead complete during the call. One that
+// cannot would wait for its fd (a tty read takes no RWF_NOWAIT, and the
+// kernel polls instead of failing an O_NONBLOCK read), so it is cancelled
+// and comes back as -EAGAIN; that costs a second call, only then.
+int uring_transfer(uring_t *u) {
+    int rc = xfer_enter(u, 0);
+    int done = xfer_reap(u, 0);
+
+    if (rc == 0 && done < u->op_count) {
+        for (int i = 0; i < u->op_count; i++) {
+            struct io_uring_sqe *sqe = u->ops[i].done ? NULL : uring_get_sqe(u);
+            if (sqe != NULL) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = i + 1;
+                sqe->user_data = URING_IGNORE;
+            }
+        }
+        while (rc == 0 && done < u->op_count) {
+            rc = xfer_enter(u, u->op_count - done);
+            done = xfer_reap(u, done);
+        }
+    }
+    if (rc < 0) {
+        // Only reachable if the kernel refused the requests outright
+        __atomic_store_n(u->sq_tail, __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        for (int i = 0; i < u->op_count; i++) {
+            u->ops[i].res = rc;
+        }
+    }
+
+    // A request that fell short ends its transfer; the kernel cancelled
+    // the ones linked behind it
+    for (int i = 0; i < u->xfer_count; i++) {
+        xfer_t *x = &u->xfers[i];
+        ssize_t total = 0;
+        for (int j = x->first; j < x->first + x->count; j++) {
+            xfer_op_t *op = &u->ops[j];
+            if (op->res < 0) {
+                if (j == x->first) {
+                    total = (op->res == -ECANCELED) ? -EAGAIN : op->res;
+                }
+                break;
+            }
+            total += op->res;
+            if ((size_t)op->res < op->len) {
+                break;
+            }
+        }
+        *x->res = total;
+    }
+    u->op_count = 0;
+    u->xfer_count = 0;
+    return rc < 0 ? -1 : 0;
+}
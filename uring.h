@@ -0,0 +1,50 @@
+// uring.h: io_uring backend for the yashd reactor
+//
+// Waits: interest in an fd is a one-shot IORING_OP_POLL_ADD that is
+// re-armed after it fires, which keeps epoll's level-triggered behaviour.
+// Arming, interest changes and removals are queued in the submission ring
+// and reach the kernel together with the next wait, in a single
+// io_uring_enter(), instead of one epoll_ctl() each.
+//
+// Transfers: reads and writes of fds that are ready, queued as
+// IORING_OP_READ/WRITE requests (the _FIXED ones for registered buffers)
+// and submitted together by uring_transfer(), one io_uring_enter() for a
+// whole batch instead of a readv() or writev() each. The fds are
+// non-blocking, so every request completes within that call, with -EAGAIN
+// where the syscall would have failed with EAGAIN; no buffer is ever in
+// the kernel's hands once it returns.
+//
+// A ring is used for waits or for transfers, not both.
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_DEFAULT_ENTRIES 1024
+#define URING_MAX_BUFFERS 16384  // Kernel limit on registered buffers
+
+typedef struct uring uring_t;
+
+// Returns NULL when the kernel lacks io_uring (or the features used here)
+uring_t *uring_open(unsigned entries);
+void uring_close(uring_t *u);
+
+// Same meaning as epoll_ctl(); *slot identifies the watch afterwards and is
+// set by EPOLL_CTL_ADD. events takes EPOLLIN/EPOLLOUT.
+int uring_ctl(uring_t *u, int op, int fd, int *slot, void *tag, uint32_t events);
+
+// Same contract as epoll_wait(); data.ptr of each event is the watch's tag
+int uring_wait(uring_t *u, struct epoll_event *events, int max, int timeout_ms);
+
+int uring_buffers(uring_t *u, unsigned count);
+int uring_buffer_add(uring_t *u, void *buf, size_t len);
+void uring_buffer_remove(uring_t *u, int index);
+int uring_read(uring_t *u, int fd, void *buf, size_t len, int index, ssize_t *res);
+int uring_write(uring_t *u, int fd, const struct iovec *iov, int cnt, int index, ssize_t *res);
+int uring_transfer(uring_t *u);
+
+#endif
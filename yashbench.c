@@ -0,0 +1,364 @@
+// yashbench: load generator and latency benchmark for yashd
+//
+// Opens N concurrent sessions, runs a command mix in each and reports
+// connection setup time, command round-trip latency percentiles, output
+// throughput and failures. -j prints one JSON object for scripts that
+// track results across commits. -s runs a setup command in every session
+// before the timed mix, e.g. "enable -n echo true cat wc" to measure the
+// shell's in-process builtins against fork/exec of the real programs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "proto.h"
+
+#define PORT 3822
+#define PROMPT "# "          // The shell's prompt ends every command's output
+#define DEFAULT_SESSIONS 10
+#define DEFAULT_COMMANDS 20
+#define DEFAULT_TIMEOUT 10   // Seconds without output before a session fails
+#define MAX_MIX 64
+
+// Command mix used when no -f file is given
+static const char *default_mix[] = {
+    "echo hello",
+    "true",
+    "ls /",
+    "cat /etc/passwd | wc -l",
+    NULL
+};
+
+// Per-session results, merged by main() after the threads finish
+typedef struct {
+    int id;
+    double connect_ms;   // connect() through the first prompt
+    double *rtt_ms;      // One entry per completed command
+    int done;
+    unsigned long bytes; // Output bytes received for commands
+    unsigned long wire;  // Frame payload bytes on the wire for them
+    int failed;          // Session aborted (connect error, EOF or timeout)
+    pthread_t thread;
+} bench_session_t;
+
+static struct sockaddr_storage server_addr;  // TCP, or yashd's Unix socket
+static socklen_t server_addr_len;
+static const char *mix[MAX_MIX + 1];
+static int mix_count;
+static int commands_per_session = DEFAULT_COMMANDS;
+static int timeout_sec = DEFAULT_TIMEOUT;
+static int use_zlib;
+static const char *setup_cmd;  // Untimed command run before the mix
+
+// Output seen while waiting for a prompt
+typedef struct {
+    char tail[2];
+    long bytes;
+} prompt_watch_t;
+
+static void watch_output(const char *data, size_t len, void *arg) {
+    prompt_watch_t *w = arg;
+    w->bytes += len;
+    if (len >= 2) {
+        w->tail[0] = data[len - 2];
+    } else {
+        w->tail[0] = w->tail[1];
+    }
+    w->tail[1] = data[len - 1];
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Read frames until the output ends with the prompt. Returns the number of
+// output bytes seen, or -1 if the connection failed or timed out. *wire
+// grows by the payload bytes that carried them.
+static long wait_prompt(int fd, frame_reader_t *reader, proto_inflater_t *in, unsigned long *wire) {
+    prompt_watch_t w = { { 0, 0 }, 0 };
+    frame_t frame;
+
+    while (1) {
+        int rc;
+        while ((rc = proto_next(reader, &frame)) == 1) {
+            if (frame.type == MSG_OUT && frame.len > 0) {
+                watch_output(frame.payload, frame.len, &w);
+            } else if (frame.type == MSG_ZOUT) {
+                if (proto_inflate(in, &frame, watch_output, &w) < 0) {
+                    return -1;
+                }
+            } else {
+                continue;
+            }
+            *wire += frame.len;
+        }
+        if (rc < 0) {
+            return -1;
+        }
+        if (w.bytes > 0 && memcmp(w.tail, PROMPT, 2) == 0) {
+            return w.bytes;
+        }
+        if (proto_reader_fill(reader, fd) <= 0) {
+            return -1;
+        }
+    }
+}
+
+static void *run_session(void *arg) {
+    bench_session_t *b = arg;
+    frame_reader_t reader;
+    proto_inflater_t *in = calloc(1, sizeof(proto_inflater_t));
+    unsigned long setup_wire = 0;
+    struct timeval tv = { timeout_sec, 0 };
+
+    if (in == NULL || proto_reader_init(&reader) < 0) {
+        free(in);
+        b->failed = 1;
+        return NULL;
+    }
+
+    double start = now_ms();
+    int fd = socket(server_addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, server_addr_len) < 0) {
+        b->failed = 1;
+        goto out;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (use_zlib && (proto_inflate_init(in) < 0 || proto_send(fd, MSG_HELLO, 0, "zlib", 4) < 0)) {
+        b->failed = 1;
+        goto out;
+    }
+
+    if (wait_prompt(fd, &reader, in, &setup_wire) < 0) {
+        b->failed = 1;
+        goto out;
+    }
+    b->connect_ms = now_ms() - start;
+
+    if (setup_cmd != NULL &&
+        (proto_send(fd, MSG_CMD, 0, setup_cmd, strlen(setup_cmd)) < 0 ||
+         wait_prompt(fd, &reader, in, &setup_wire) < 0)) {
+        b->failed = 1;
+        goto out;
+    }
+
+    for (int i = 0; i < commands_per_session; i++) {
+        const char *cmd = mix[(b->id + i) % mix_count];
+        double sent = now_ms();
+
+        if (proto_send(fd, MSG_CMD, 0, cmd, strlen(cmd)) < 0) {
+            b->failed = 1;
+            break;
+        }
+        long bytes = wait_prompt(fd, &reader, in, &b->wire);
+        if (bytes < 0) {
+            b->failed = 1;
+            break;
+        }
+        b->rtt_ms[b->done++] = now_ms() - sent;
+        b->bytes += bytes;
+    }
+
+out:
+    if (fd >= 0) {
+        // End the session rather than leave it detached for the grace period
+        proto_send(fd, MSG_CTL, 0, "q", 1);
+        close(fd);
+    }
+    proto_reader_free(&reader);
+    proto_inflate_end(in);
+    free(in);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static double percentile(const double *v, int n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    int k = (int)(p / 100.0 * n + 0.5);
+    if (k < 1) {
+        k = 1;
+    }
+    if (k > n) {
+        k = n;
+    }
+    return v[k - 1];
+}
+
+// Load the command mix from a file, one command per line
+static void load_mix(const char *path) {
+    char line[PROTO_MAX_PAYLOAD];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Failed to open command mix");
+        exit(EXIT_FAILURE);
+    }
+    while (mix_count < MAX_MIX && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#') {
+            mix[mix_count++] = strdup(line);
+        }
+    }
+    fclose(fp);
+    if (mix_count == 0) {
+        fprintf(stderr, "No commands in %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n sessions] [-c commands] [-f mix_file] [-s setup_cmd] [-p port] [-t timeout] [-z] [-j] [ip | socket_path]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int sessions = DEFAULT_SESSIONS;
+    int port = PORT;
+    int json = 0;
+    const char *mix_file = NULL;
+    const char *ip = "127.0.0.1";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:f:s:p:t:zj")) != -1) {
+        switch (opt) {
+        case 'n': sessions = atoi(optarg); break;
+        case 'c': commands_per_session = atoi(optarg); break;
+        case 'f': mix_file = optarg; break;
+        case 's': setup_cmd = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 't': timeout_sec = atoi(optarg); break;
+        case 'z': use_zlib = 1; break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        ip = argv[optind];
+    }
+    if (sessions <= 0 || commands_per_session < 0) {
+        usage(argv[0]);
+    }
+
+    if (mix_file != NULL) {
+        load_mix(mix_file);
+    } else {
+        for (mix_count = 0; default_mix[mix_count] != NULL; mix_count++) {
+            mix[mix_count] = default_mix[mix_count];
+        }
+    }
+
+    // A path is yashd's Unix socket, anything else an IPv4 address
+    memset(&server_addr, 0, sizeof(server_addr));
+    if (strchr(ip, '/') != NULL) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&server_addr;
+        if (strlen(ip) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", ip);
+            exit(EXIT_FAILURE);
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, ip);
+        server_addr_len = sizeof(*un);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&server_addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        if (inet_pton(AF_INET, ip, &in->sin_addr) <= 0) {
+            fprintf(stderr, "Invalid address: %s\n", ip);
+            exit(EXIT_FAILURE);
+        }
+        server_addr_len = sizeof(*in);
+    }
+
+    bench_session_t *bs = calloc(sessions, sizeof(bench_session_t));
+    if (bs == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < sessions; i++) {
+        bs[i].id = i;
+        bs[i].rtt_ms = calloc(commands_per_session + 1, sizeof(double));
+        if (bs[i].rtt_ms == NULL || pthread_create(&bs[i].thread, NULL, run_session, &bs[i]) != 0) {
+            fprintf(stderr, "Failed to start session %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < sessions; i++) {
+        pthread_join(bs[i].thread, NULL);
+    }
+    double elapsed_ms = now_ms() - start;
+
+    // Merge per-session results
+    double *connect = calloc(sessions, sizeof(double));
+    double *rtt = calloc((size_t)sessions * commands_per_session + 1, sizeof(double));
+    if (connect == NULL || rtt == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    int connected = 0, completed = 0, failures = 0;
+    unsigned long bytes = 0, wire = 0;
+
+    for (int i = 0; i < sessions; i++) {
+        if (bs[i].connect_ms > 0) {
+            connect[connected++] = bs[i].connect_ms;
+        }
+        memcpy(rtt + completed, bs[i].rtt_ms, bs[i].done * sizeof(double));
+        completed += bs[i].done;
+        bytes += bs[i].bytes;
+        wire += bs[i].wire;
+        failures += bs[i].failed;
+    }
+    qsort(connect, connected, sizeof(double), cmp_double);
+    qsort(rtt, completed, sizeof(double), cmp_double);
+
+    double secs = elapsed_ms / 1000.0;
+    if (json) {
+        printf("{\"sessions\":%d,\"commands\":%d,\"failures\":%d,\"elapsed_ms\":%.1f,"
+               "\"connect_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+               "\"rtt_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+               "\"commands_per_sec\":%.1f,\"output_bytes\":%lu,\"output_bytes_per_sec\":%.0f,"
+               "\"wire_bytes\":%lu,\"zlib\":%d}\n",
+               sessions, completed, failures, elapsed_ms,
+               percentile(connect, connected, 50), percentile(connect, connected, 90),
+               percentile(connect, connected, 99), percentile(connect, connected, 100),
+               percentile(rtt, completed, 50), percentile(rtt, completed, 90),
+               percentile(rtt, completed, 99), percentile(rtt, completed, 100),
+               completed / secs, bytes, bytes / secs, wire, use_zlib);
+    } else {
+        printf("sessions:    %d (%d failed)\n", sessions, failures);
+        printf("commands:    %d in %.2fs (%.1f/s)\n", completed, secs, completed / secs);
+        printf("connect ms:  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+               percentile(connect, connected, 50), percentile(connect, connected, 90),
+               percentile(connect, connected, 99), percentile(connect, connected, 100));
+        printf("rtt ms:      p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+               percentile(rtt, completed, 50), percentile(rtt, completed, 90),
+               percentile(rtt, completed, 99), percentile(rtt, completed, 100));
+        printf("output:      %lu bytes (%.0f bytes/s), %lu on the wire%s\n",
+               bytes, bytes / secs, wire, use_zlib ? " (zlib)" : "");
+    }
+
+    for (int i = 0; i < sessions; i++) {
+        free(bs[i].rtt_ms);
+    }
+    free(bs);
+    free(connect);
+    free(rtt);
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
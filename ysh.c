@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ysh.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,460 +6,1597 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <time.h>
+#include <spawn.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
-// Global variables
-pid_t stopped_stack[STACK_SIZE];
-int stack_top = -1;
-pid_t foreground_pid = -1;
-Job *head = NULL;
-Job *tail = NULL;
-int job_count = 0;
-char *current_command_line = NULL;
+// glibc 2.35 can hand the terminal to a spawned child itself
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
 
-// Stack functions for managing stopped processes
-void push(pid_t pid) {
-    if (stack_top < STACK_SIZE - 1) {
-        stopped_stack[++stack_top] = pid;
+extern char **environ;
+
+// Signals are per process, so these are the only state outside a context:
+// every live context (for reap_jobs()) and the one whose foreground job
+// Ctrl-C and Ctrl-Z are meant for
+static YshContext *contexts = NULL;
+static YshContext *signal_ctx = NULL;
+static volatile sig_atomic_t sigchld_pending = 0;
+
+static unsigned job_bucket(int key) {
+    return (unsigned)key % JOB_BUCKETS;
+}
+
+// Jobs come from slabs of JOB_SLAB and are recycled through a free list
+static Job *alloc_job(YshContext *ctx) {
+    if (ctx->jobs.free_list == NULL) {
+        JobSlab *slab = malloc(sizeof(JobSlab));
+        if (!slab) {
+            return NULL;
+        }
+        slab->next = ctx->jobs.slabs;
+        ctx->jobs.slabs = slab;
+        for (int i = 0; i < JOB_SLAB; i++) {
+            slab->jobs[i].next = ctx->jobs.free_list;
+            ctx->jobs.free_list = &slab->jobs[i];
+        }
     }
+    Job *job = ctx->jobs.free_list;
+    ctx->jobs.free_list = job->next;
+    memset(job, 0, sizeof(Job));
+    return job;
 }
 
-pid_t pop() {
-    if (stack_top >= 0) {
-        return stopped_stack[stack_top--];
+// Recency list of stopped jobs: the head is the current ("+") job
+static void unlink_stopped(YshContext *ctx, Job *job) {
+    if (!job->on_stopped_list) {
+        return;
     }
-    return -1;
+    if (job->stop_prev) {
+        job->stop_prev->stop_next = job->stop_next;
+    } else {
+        ctx->jobs.stopped = job->stop_next;
+    }
+    if (job->stop_next) {
+        job->stop_next->stop_prev = job->stop_prev;
+    }
+    job->stop_prev = job->stop_next = NULL;
+    job->on_stopped_list = 0;
 }
 
-pid_t peek() {
-    if (stack_top >= 0) {
-        return stopped_stack[stack_top];
+static void mark_stopped(YshContext *ctx, Job *job) {
+    unlink_stopped(ctx, job);
+    job->status = SUSPENDED;
+    job->stop_next = ctx->jobs.stopped;
+    if (ctx->jobs.stopped) {
+        ctx->jobs.stopped->stop_prev = job;
     }
-    return -1;
+    ctx->jobs.stopped = job;
+    job->on_stopped_list = 1;
+}
+
+static void mark_running(YshContext *ctx, Job *job) {
+    unlink_stopped(ctx, job);
+    job->status = RUNNING;
+}
+
+// Exit status the way sh reports it: 128 + the signal for a killed process
+static int exit_status(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Fold one reaped process (or job) into a running total. Peak memory is a
+// maximum; the rest add up.
+static void add_usage(struct rusage *total, const struct rusage *ru) {
+    timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+    if (ru->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = ru->ru_maxrss;
+    }
+    total->ru_minflt += ru->ru_minflt;
+    total->ru_majflt += ru->ru_majflt;
+    total->ru_inblock += ru->ru_inblock;
+    total->ru_oublock += ru->ru_oublock;
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+// A job's last process was reaped: charge it to the shell and drop it
+static void finish_job(YshContext *ctx, Job *job) {
+    job->status = DONE;
+    add_usage(&ctx->usage, &job->usage);
+    ctx->jobs_done++;
+    remove_job(ctx, job->pgid);
 }
 
 // Job control functions
-void add_job(pid_t pgid, char *command, JobStatus status, int print) {
-    Job *new_job = (Job *)malloc(sizeof(Job));
+Job *add_job(YshContext *ctx, pid_t pgid, char *command, JobStatus status, int procs, int print) {
+    Job *new_job = alloc_job(ctx);
     if (!new_job) {
         perror("malloc failed");
-        return;
+        return NULL;
     }
 
-    new_job->job_id = ++job_count;
+    new_job->job_id = ctx->jobs.tail ? ctx->jobs.tail->job_id + 1 : 1;
     new_job->pgid = pgid;
-    new_job->status = status;
+    new_job->status = RUNNING;
+    new_job->live = procs;
+    gettimeofday(&new_job->started, NULL);
     strncpy(new_job->command, command, 255);
     new_job->command[255] = '\0';
-    new_job->next = NULL;
 
-    // Add the job to the linked list
-    if (head == NULL) {
-        head = new_job;
-        tail = new_job;
+    // Drop a trailing "&" and blanks from the remembered command line
+    size_t len = strlen(new_job->command);
+    while (len > 0 && (new_job->command[len - 1] == ' ' || new_job->command[len - 1] == '&')) {
+        new_job->command[--len] = '\0';
+    }
+
+    // Append in job id order and index by pgid and job id
+    new_job->prev = ctx->jobs.tail;
+    if (ctx->jobs.tail) {
+        ctx->jobs.tail->next = new_job;
     } else {
-        tail->next = new_job;
-        tail = new_job;
+        ctx->jobs.head = new_job;
+    }
+    ctx->jobs.tail = new_job;
+
+    unsigned b = job_bucket(pgid);
+    new_job->pgid_next = ctx->jobs.by_pgid[b];
+    ctx->jobs.by_pgid[b] = new_job;
+    b = job_bucket(new_job->job_id);
+    new_job->id_next = ctx->jobs.by_id[b];
+    ctx->jobs.by_id[b] = new_job;
+    ctx->jobs.count++;
+
+    if (status == SUSPENDED) {
+        mark_stopped(ctx, new_job);
     }
 
     if (print != 0) {
         printf("[%d] %d %s &\n", new_job->job_id, new_job->pgid, new_job->command);
     }
+    return new_job;
 }
 
-void remove_job(pid_t pid) {
-    Job *current = head;
-    Job *previous = NULL;
+void remove_job(YshContext *ctx, pid_t pgid) {
+    Job **link = &ctx->jobs.by_pgid[job_bucket(pgid)];
+    while (*link != NULL && (*link)->pgid != pgid) {
+        link = &(*link)->pgid_next;
+    }
+    Job *job = *link;
+    if (job == NULL) {
+        return;
+    }
+    *link = job->pgid_next;
+
+    link = &ctx->jobs.by_id[job_bucket(job->job_id)];
+    while (*link != job) {
+        link = &(*link)->id_next;
+    }
+    *link = job->id_next;
 
-    while (current != NULL && current->pgid != pid) {
-        previous = current;
-        current = current->next;
+    if (job->prev) {
+        job->prev->next = job->next;
+    } else {
+        ctx->jobs.head = job->next;
     }
+    if (job->next) {
+        job->next->prev = job->prev;
+    } else {
+        ctx->jobs.tail = job->prev;
+    }
+    unlink_stopped(ctx, job);
 
-    if (current != NULL) {
-        if (previous == NULL) {
-            head = current->next;
-        } else {
-            previous->next = current->next;
-        }
+    job->next = ctx->jobs.free_list;
+    ctx->jobs.free_list = job;
+    ctx->jobs.count--;
+}
 
-        if (current == tail) {
-            tail = previous;
+Job* find_job(YshContext *ctx, pid_t pgid) {
+    for (Job *job = ctx->jobs.by_pgid[job_bucket(pgid)]; job != NULL; job = job->pgid_next) {
+        if (job->pgid == pgid) {
+            return job;
         }
-
-        free(current);
-        job_count--;
     }
+    return NULL;
 }
 
-Job* find_job(pid_t pgid) {
-    Job *current = head;
-
-    while (current != NULL) {
-        if (current->pgid == pgid) {
-            return current;
+Job* find_job_by_id(YshContext *ctx, int job_id) {
+    for (Job *job = ctx->jobs.by_id[job_bucket(job_id)]; job != NULL; job = job->id_next) {
+        if (job->job_id == job_id) {
+            return job;
         }
-        current = current->next;
     }
     return NULL;
 }
 
-// List jobs
-void list_jobs() {
-    Job *current = head;
+// Collect status changes the SIGCHLD handler flagged. Runs from the main
+// loop, never in signal context, so the tables are only touched here.
+// Children are reaped process-wide, so each one is credited to whichever
+// context owns its process group.
+void reap_jobs() {
+    siginfo_t info;
+    struct rusage ru;
+    int status;
 
-    if (current == NULL) {
+    if (!sigchld_pending) {
         return;
     }
+    sigchld_pending = 0;
 
-    pid_t most_recent_stopped_pid = peek();
+    while (1) {
+        // Peek first: the process group is only known while the child still exists
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) {
+            break;
+        }
+        pid_t pgid = getpgid(info.si_pid);
+        if (wait4(info.si_pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru) <= 0) {
+            break;
+        }
+
+        Job *job = NULL;
+        YshContext *ctx = contexts;
+        while (ctx != NULL && (job = find_job(ctx, pgid)) == NULL) {
+            ctx = ctx->next;
+        }
+        if (job == NULL) {
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            mark_stopped(ctx, job);
+        } else if (WIFCONTINUED(status)) {
+            mark_running(ctx, job);
+        } else {
+            add_usage(&job->usage, &ru);
+            if (info.si_pid == job->last_pid) {
+                job->exit_status = exit_status(status);
+            }
+        }
+        if (!WIFSTOPPED(status) && !WIFCONTINUED(status) && --job->live <= 0) {
+            finish_job(ctx, job);  // Clean up finished jobs
+        }
+    }
+}
 
-    while (current != NULL) {
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// "jobs -v" columns: CPU and peak memory of the processes reaped so far
+static void print_usage(const struct rusage *ru) {
+    printf("user %.2fs  sys %.2fs  maxrss %ldK", seconds(ru->ru_utime), seconds(ru->ru_stime), ru->ru_maxrss);
+}
+
+// "jobs -v" footer: what the shell has used so far and the limits it runs under
+static void print_session_usage(YshContext *ctx) {
+    static const struct { const char *name; int resource; } limits[] = {
+        { "cpu", RLIMIT_CPU }, { "as", RLIMIT_AS }, { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC },
+    };
+    struct rlimit rl;
+
+    printf("Session: %lu jobs done  ", ctx->jobs_done);
+    print_usage(&ctx->usage);
+    printf("\nLimits: ");
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        if (getrlimit(limits[i].resource, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY) {
+            printf("%s=unlimited ", limits[i].name);
+        } else {
+            printf("%s=%llu ", limits[i].name, (unsigned long long)rl.rlim_cur);
+        }
+    }
+    printf("\n");
+}
+
+// List jobs; verbose adds resource usage per job and for the whole shell
+void list_jobs(YshContext *ctx, int verbose) {
+    struct timeval now;
+
+    reap_jobs();
+    gettimeofday(&now, NULL);
+
+    for (Job *current = ctx->jobs.head; current != NULL; current = current->next) {
         printf("[%d] ", current->job_id);
         if (current->status == RUNNING) {
             printf("Running   ");
-        } else if (current->status == SUSPENDED && current->pgid == most_recent_stopped_pid) {
+        } else if (current->status == SUSPENDED && current == ctx->jobs.stopped) {
             printf("+ Suspended   ");
-        } else if (current->status == SUSPENDED && current->pgid != most_recent_stopped_pid) {
+        } else if (current->status == SUSPENDED) {
             printf("- Suspended   ");
         } else if (current->status == DONE) {
             printf("Done      ");
         }
         printf("PGID: %d   %s\n", current->pgid, current->command);
-        current = current->next;
+        if (verbose) {
+            struct timeval elapsed;
+            timersub(&now, &current->started, &elapsed);
+            printf("    elapsed %.2fs  ", seconds(elapsed));
+            print_usage(&current->usage);
+            printf("\n");
+        }
     }
-}
-
-// Foreground and background commands
-void fg_command() {
-    pid_t most_recent_stopped_pid = peek();
-
-    if (most_recent_stopped_pid == -1) {
-        printf("fg: no current job\n");
-        return;
+    if (verbose) {
+        print_session_usage(ctx);
     }
+}
 
-    Job *current = find_job(most_recent_stopped_pid);
+// Run a job in the foreground until it finishes or stops. A finished job
+// leaves the table; a stopped one becomes the current job. Either way the
+// outcome becomes the shell's last status.
+void wait_for_job(YshContext *ctx, Job *job) {
+    ctx->foreground_pid = job->pgid;
+    give_terminal(job->pgid);
 
-    if (current != NULL) {
-        if (current->status == SUSPENDED) {
-            kill(-current->pgid, SIGCONT);
-        }
-        pop();
-        printf("[%d] continued %s\n", current->job_id, current->command);
-        current->status = RUNNING;
-        foreground_pid = current->pgid;
+    while (job->live > 0) {
         int status;
-        waitpid(-current->pgid, &status, WUNTRACED);
+        struct rusage ru;
+        pid_t pid = wait4(-job->pgid, &status, WUNTRACED, &ru);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            job->live = 0;
+            break;
+        }
         if (WIFSTOPPED(status)) {
-            current->status = SUSPENDED;
-            foreground_pid = -1;
-        } else {
-            current->status = DONE;
-            remove_job(current->pgid);
-            foreground_pid = -1;
+            mark_stopped(ctx, job);
+            printf("\n[%d]+ Suspended   %s\n", job->job_id, job->command);
+            ctx->last_status = 128 + WSTOPSIG(status);
+            break;
         }
+        add_usage(&job->usage, &ru);
+        if (pid == job->last_pid) {
+            job->exit_status = exit_status(status);
+        }
+        job->live--;
+    }
+
+    give_terminal(getpgrp());  // Return control to the shell
+    ctx->foreground_pid = -1;
+    if (job->live <= 0) {
+        ctx->last_status = job->exit_status;
+        ctx->last_usage = job->usage;
+        finish_job(ctx, job);
     }
 }
 
-void bg_command() {
-    pid_t most_recent_stopped_pid = peek();
+// Pick the job named by "fg"/"bg" arguments: [%]N, or the current stopped job
+static Job *job_from_args(YshContext *ctx, char *arg) {
+    if (arg == NULL) {
+        return ctx->jobs.stopped;
+    }
+    if (*arg == '%') {
+        arg++;
+    }
+    return find_job_by_id(ctx, atoi(arg));
+}
 
-    if (most_recent_stopped_pid == -1) {
-        printf("bg: no current job\n");
+// Foreground and background commands
+void fg_command(YshContext *ctx, char *arg) {
+    reap_jobs();
+    Job *current = job_from_args(ctx, arg);
+
+    if (current == NULL) {
+        printf("fg: no current job\n");
+        ctx->last_status = 1;
         return;
     }
 
-    Job *current = find_job(most_recent_stopped_pid);
+    if (current->status == SUSPENDED) {
+        kill(-current->pgid, SIGCONT);
+    }
+    printf("[%d] continued %s\n", current->job_id, current->command);
+    mark_running(ctx, current);
+    wait_for_job(ctx, current);
+}
+
+void bg_command(YshContext *ctx, char *arg) {
+    reap_jobs();
+    Job *current = job_from_args(ctx, arg);
 
     if (current != NULL) {
         if (current->status == SUSPENDED) {
             kill(-current->pgid, SIGCONT);
         }
-        pop();
-        current->status = RUNNING;
+        mark_running(ctx, current);
         printf("[%d] %s &\n", current->job_id, current->command);
+        ctx->last_status = 0;
     } else {
         printf("bg: no current job\n");
+        ctx->last_status = 1;
     }
 }
 
-// Redirection
-int redirection(char **args) {
-    int in_fd = -1, out_fd = -1;
+// Operator tokens from parse_line(); words point into the line itself, so
+// a quoted "<" or ">" never compares equal to these
+static char redir_in_token[] = "<";
+static char redir_out_token[] = ">";
+
+// Redirection: open the files named by < and > (close-on-exec, so only the
+// dup2()'d copies reach the command) and strip them from args
+int redirection(char **args, int *in_fd, int *out_fd) {
+    *in_fd = -1;
+    *out_fd = -1;
 
     for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0) {
-            in_fd = open(args[i + 1], O_RDONLY);
-            if (in_fd == -1) {
+        if (args[i] == redir_in_token) {
+            *in_fd = open(args[i + 1], O_RDONLY | O_CLOEXEC);
+            if (*in_fd == -1) {
                 perror("Failed to open input file");
-                return -1;
+                goto fail;
             }
-            dup2(in_fd, STDIN_FILENO);
-            close(in_fd);
             args[i] = NULL;
             i++;
-        } else if (strcmp(args[i], ">") == 0) {
-            out_fd = open(args[i + 1], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-            if (out_fd == -1) {
+        } else if (args[i] == redir_out_token) {
+            *out_fd = open(args[i + 1], O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (*out_fd == -1) {
                 perror("Failed to open output file");
-                return -1;
+                goto fail;
             }
-            dup2(out_fd, STDOUT_FILENO);
-            close(out_fd);
             args[i] = NULL;
             i++;
         }
     }
     return 0;
+
+fail:
+    if (*in_fd != -1) {
+        close(*in_fd);
+    }
+    *in_fd = -1;
+    return -1;
 }
 
-// Handle pipe commands
-int do_pipe(char **left_cmd, char **right_cmd) {
-    int pfd[2];
+// Hand the controlling terminal to a foreground job (or back to the shell)
+void give_terminal(pid_t pgid) {
+    if (isatty(STDIN_FILENO)) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+}
 
-    if (pipe(pfd) == -1) {
-        perror("pipe failed");
-        return -1;
+// Undo the shell's own signal setup in a child that is about to exec
+static void reset_child_signals() {
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+}
+
+// The same for a child that runs shell code without exec, where the
+// shell's handlers would otherwise survive too
+static void reset_forked_signals() {
+    reset_child_signals();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+}
+
+// Executable path cache (the "hash" builtin): command name -> absolute
+// path, so PATH is only walked the first time a command runs. The table
+// is dropped whenever PATH changes, and an entry is dropped when its file
+// has disappeared.
+
+static unsigned path_hash(const char *name) {
+    unsigned h = 2166136261u;  // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
     }
+    return h % PATH_BUCKETS;
+}
 
-    int lpid = fork();
-    if (lpid == -1) {
-        perror("fork failed");
-        return -1;
+void hash_reset(YshContext *ctx) {
+    for (int i = 0; i < PATH_BUCKETS; i++) {
+        while (ctx->path_table[i] != NULL) {
+            PathEntry *e = ctx->path_table[i];
+            ctx->path_table[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
     }
+}
 
-    if (lpid == 0) {
-        dup2(pfd[1], STDOUT_FILENO);
-        close(pfd[0]);
-        close(pfd[1]);
-        redirection(left_cmd);
-        execvp(left_cmd[0], left_cmd);
-        perror("execvp failed");
-        exit(EXIT_FAILURE);
+static void hash_forget(YshContext *ctx, const char *name) {
+    PathEntry **link = &ctx->path_table[path_hash(name)];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            PathEntry *e = *link;
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &(*link)->next;
     }
+}
 
-    int rpid = fork();
-    if (rpid == -1) {
-        perror("fork failed");
-        return -1;
+// Walk PATH the way execvp() does and return the first executable match
+static char *search_path(const char *name, const char *path_env) {
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        char *candidate = malloc(dir_len + name_len + 2);
+
+        if (dir_len == 0) {
+            strcpy(candidate, name);  // An empty entry means the current directory
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
     }
+}
 
-    if (rpid == 0) {
-        dup2(pfd[0], STDIN_FILENO);
-        close(pfd[1]);
-        close(pfd[0]);
-        redirection(right_cmd);
-        execvp(right_cmd[0], right_cmd);
-        perror("execvp failed");
-        exit(EXIT_FAILURE);
+// Resolve a command name to the path to exec. Names containing '/' are
+// used as they are. Returns NULL when nothing on PATH matches.
+const char *hash_lookup(YshContext *ctx, const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
     }
 
-    close(pfd[0]);
-    close(pfd[1]);
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "/bin:/usr/bin";
+    }
+    if (ctx->hashed_path_env == NULL || strcmp(ctx->hashed_path_env, path_env) != 0) {
+        hash_reset(ctx);
+        free(ctx->hashed_path_env);
+        ctx->hashed_path_env = strdup(path_env);
+    }
 
-    waitpid(lpid, NULL, 0);
-    waitpid(rpid, NULL, 0);
+    unsigned bucket = path_hash(name);
+    for (PathEntry *e = ctx->path_table[bucket]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
 
-    return 0;
+    char *path = search_path(name, path_env);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    PathEntry *e = malloc(sizeof(PathEntry));
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 1;
+    e->next = ctx->path_table[bucket];
+    ctx->path_table[bucket] = e;
+    return path;
 }
 
-// Parsing commands
-char **parse_command(char *command) {
-    char **args = malloc(MAX_ARGS * sizeof(char *));
-    char *cmd_copy = strdup(command);
-    char *token;
-    int index = 0;
+// hash         list remembered commands
+// hash -r      forget them all
+// hash NAME... look NAME up now and remember it
+void hash_command(YshContext *ctx, char **args) {
+    if (args[1] == NULL) {
+        int any = 0;
+        for (int i = 0; i < PATH_BUCKETS; i++) {
+            for (PathEntry *e = ctx->path_table[i]; e != NULL; e = e->next) {
+                if (!any) {
+                    printf("hits\tcommand\n");
+                    any = 1;
+                }
+                printf("%4u\t%s\n", e->hits, e->path);
+            }
+        }
+        if (!any) {
+            printf("hash: hash table empty\n");
+        }
+        return;
+    }
 
-    token = strtok(cmd_copy, " ");
-    while (token != NULL && index < MAX_ARGS - 1) {
-        args[index++] = strdup(token);
-        token = strtok(NULL, " ");
+    if (strcmp(args[1], "-r") == 0) {
+        hash_reset(ctx);
+        return;
     }
-    args[index] = NULL;
 
-    free(cmd_copy);
-    return args;
+    for (int i = 1; args[i] != NULL; i++) {
+        hash_forget(ctx, args[i]);
+        if (hash_lookup(ctx, args[i]) == NULL) {
+            printf("hash: %s: not found\n", args[i]);
+        } else if (strchr(args[i], '/') == NULL) {
+            ctx->path_table[path_hash(args[i])]->hits = 0;  // Just inserted at the head; not run yet
+        }
+    }
 }
 
-// Handle pipes
-int split_pipe(char *command, char **left_cmd, char **right_cmd) {
-    char *token = strtok(command, "|");
-    if (token) {
-        *left_cmd = token;
-        token = strtok(NULL, "|");
-
-        if (token) {
-            *right_cmd = token;
-            return 1;
+// In-process utilities: echo, true, cat and wc run inside the shell rather
+// than through fork/exec. A lone foreground command that does not read
+// stdin runs in the shell itself; otherwise a forked child runs the
+// builtin without exec. Options a builtin does not know, "command NAME"
+// and "enable -n NAME" all fall back to the real program.
+#define BUILTIN_IO_SIZE 65536
+
+typedef struct {
+    int fd;
+    size_t len;
+    int failed;
+    char buf[8192];
+} OutBuf;
+
+static volatile sig_atomic_t builtin_interrupted = 0;
+
+static int out_flush(OutBuf *o) {
+    for (size_t off = 0; off < o->len && !o->failed; ) {
+        ssize_t w = write(o->fd, o->buf + off, o->len - off);
+        if (w < 0 && errno == EINTR && !builtin_interrupted) {
+            continue;
         }
-        *right_cmd = NULL;
-        return 0;
+        if (w <= 0) {
+            o->failed = 1;
+            break;
+        }
+        off += w;
     }
-    *left_cmd = command;
-    *right_cmd = NULL;
-    return 0;
+    o->len = 0;
+    return o->failed ? -1 : 0;
 }
 
-// Signal handlers
-void sigint_handler(int sig) {
-    // Handle Ctrl+C (SIGINT)
-    if (foreground_pid > 0) {
-        kill(foreground_pid, SIGINT);  // Send SIGINT to the foreground job
+static void out_put(OutBuf *o, const char *data, size_t len) {
+    while (len > 0 && !o->failed) {
+        size_t n = sizeof(o->buf) - o->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        data += n;
+        len -= n;
+        if (o->len == sizeof(o->buf)) {
+            out_flush(o);
+        }
     }
 }
 
-void sigtstp_handler(int sig) {
-    // Handle Ctrl+Z (SIGTSTP)
-    if (foreground_pid > 0) {
-        kill(foreground_pid, SIGTSTP);  // Suspend the foreground job
+// Read into buf, retrying interrupted reads unless Ctrl-C was pressed
+static ssize_t builtin_read(int fd, char *buf, size_t len) {
+    ssize_t n;
+    while ((n = read(fd, buf, len)) < 0 && errno == EINTR && !builtin_interrupted)
+        ;
+    return n;
+}
+
+// Open a file operand ("-" is stdin). Returns -1 after reporting an error.
+static int builtin_open(const char *cmd, const char *name, int in_fd) {
+    if (strcmp(name, "-") == 0) {
+        return in_fd;
+    }
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        dprintf(STDERR_FILENO, "%s: %s: %s\n", cmd, name, strerror(errno));
     }
+    return fd;
 }
 
-void sigchld_handler(int sig) {
-    // Handle child process cleanup
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            remove_job(pid);  // Clean up finished jobs
+static int builtin_true(char **args, int in_fd, int out_fd) {
+    return 0;
+}
+
+static int builtin_echo(char **args, int in_fd, int out_fd) {
+    OutBuf o = { out_fd, 0, 0 };
+    int newline = 1;
+    int i = 1;
+
+    if (args[1] != NULL && args[1][0] == '-' && args[1][1] != '\0' &&
+        strspn(args[1] + 1, "n") == strlen(args[1] + 1)) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) {
+            out_put(&o, " ", 1);
         }
+        out_put(&o, args[i], strlen(args[i]));
     }
+    if (newline) {
+        out_put(&o, "\n", 1);
+    }
+    return out_flush(&o) < 0 ? 1 : 0;
 }
 
-void ysh_loop() {
-    int cpid;
-    char *inString;
-    char **parsedcmd;
-    int if_bg; //background
+// Copy fd to out_fd. Returns -1 on a read error or a closed output.
+static int cat_fd(int fd, int out_fd, char *buf) {
+    ssize_t n;
 
-    pid_t pgid = 0;
-    pid_t pipe_pids[MAX_PIDS]; //used in pipe for multiple PIDs
+    while ((n = builtin_read(fd, buf, BUILTIN_IO_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w < 0 && errno == EINTR && !builtin_interrupted) {
+                continue;
+            }
+            if (w <= 0) {
+                return -1;
+            }
+            off += w;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
 
-    // Setup signal handlers
-    signal(SIGINT, sigint_handler);    // Handle Ctrl+C
-    signal(SIGTSTP, sigtstp_handler);  // Handle Ctrl+Z
-    signal(SIGCHLD, sigchld_handler);  // Handle child process cleanup
+static int builtin_cat(char **args, int in_fd, int out_fd) {
+    char *buf = malloc(BUILTIN_IO_SIZE);
+    int status = 0;
 
-    char *left_cmd = NULL, *right_cmd = NULL;
+    if (buf == NULL) {
+        return 1;
+    }
+    if (args[1] == NULL) {
+        status = cat_fd(in_fd, out_fd, buf) < 0;
+    }
+    for (int i = 1; args[i] != NULL && !builtin_interrupted; i++) {
+        int fd = builtin_open("cat", args[i], in_fd);
+        if (fd < 0) {
+            status = 1;
+            continue;
+        }
+        if (cat_fd(fd, out_fd, buf) < 0) {
+            status = 1;
+        }
+        if (fd != in_fd) {
+            close(fd);
+        }
+    }
+    free(buf);
+    return status;
+}
 
-    while ((inString = readline("# "))) {
+typedef struct {
+    unsigned long lines;
+    unsigned long words;
+    unsigned long bytes;
+} WcCount;
+
+static int wc_fd(int fd, WcCount *c, char *buf) {
+    int in_word = 0;
+    ssize_t n;
+
+    while ((n = builtin_read(fd, buf, BUILTIN_IO_SIZE)) > 0) {
+        c->bytes += n;
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char ch = buf[i];
+            if (ch == '\n') {
+                c->lines++;
+            }
+            if (isspace(ch)) {
+                in_word = 0;
+            } else if (!in_word) {
+                in_word = 1;
+                c->words++;
+            }
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
 
-        if (current_command_line != NULL) {
-            free(current_command_line);
+// One line of wc output: the selected counts, then the name if any. A
+// single count for stdin is printed bare, like coreutils does.
+static void wc_print(OutBuf *o, const WcCount *c, int show, const char *name) {
+    unsigned long values[3] = { c->lines, c->words, c->bytes };
+    int width = (show == 1 || show == 2 || show == 4) && name == NULL ? 0 : 7;
+    char field[32];
+    int first = 1;
+
+    for (int k = 0; k < 3; k++) {
+        if (show & (1 << k)) {
+            int len = snprintf(field, sizeof(field), "%s%*lu", first ? "" : " ", width, values[k]);
+            out_put(o, field, len);
+            first = 0;
         }
-        current_command_line = strdup(inString);
+    }
+    if (name != NULL) {
+        out_put(o, " ", 1);
+        out_put(o, name, strlen(name));
+    }
+    out_put(o, "\n", 1);
+}
 
-        if_bg = 0;
+static int builtin_wc(char **args, int in_fd, int out_fd) {
+    OutBuf o = { out_fd, 0, 0 };
+    WcCount total = { 0, 0, 0 };
+    int show = 0;
+    int files = 0;
+    int status = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (const char *f = args[i] + 1; *f; f++) {
+            show |= (*f == 'l') ? 1 : (*f == 'w') ? 2 : 4;
+        }
+    }
+    if (show == 0) {
+        show = 7;
+    }
 
-        if (strcmp(inString, "jobs") == 0) {
-            list_jobs();
-            free(inString);
+    char *buf = malloc(BUILTIN_IO_SIZE);
+    if (buf == NULL) {
+        return 1;
+    }
+    if (args[i] == NULL) {
+        if (wc_fd(in_fd, &total, buf) < 0) {
+            status = 1;
+        }
+        wc_print(&o, &total, show, NULL);
+    }
+    for (; args[i] != NULL && !builtin_interrupted; i++, files++) {
+        WcCount c = { 0, 0, 0 };
+        int fd = builtin_open("wc", args[i], in_fd);
+        if (fd < 0) {
+            status = 1;
             continue;
         }
+        if (wc_fd(fd, &c, buf) < 0) {
+            status = 1;
+        }
+        if (fd != in_fd) {
+            close(fd);
+        }
+        wc_print(&o, &c, show, args[i]);
+        total.lines += c.lines;
+        total.words += c.words;
+        total.bytes += c.bytes;
+    }
+    if (files > 1) {
+        wc_print(&o, &total, show, "total");
+    }
+    free(buf);
+    return (out_flush(&o) < 0) ? 1 : status;
+}
 
-        if (strncmp(inString, "fg", 2) == 0) {
-            fg_command();
-            free(inString);
+// The registry; opts lists the single-letter options each one handles
+static const Builtin builtins[] = {
+    { "echo", builtin_echo, "n" },
+    { "true", builtin_true, NULL },
+    { "cat", builtin_cat, "" },
+    { "wc", builtin_wc, "lwc" },
+};
+
+#define BUILTIN_COUNT (int)(sizeof(builtins) / sizeof(builtins[0]))
+#define BUILTIN_ON(ctx, b) (((ctx)->builtins_off & (1u << (b))) == 0)
+
+// The enabled builtin for a command, or NULL if it must run externally.
+// Leading options are checked against what the builtin implements; true
+// takes no options and ignores its arguments.
+const Builtin *builtin_lookup(YshContext *ctx, char **args) {
+    for (int b = 0; b < BUILTIN_COUNT; b++) {
+        if (!BUILTIN_ON(ctx, b) || strcmp(builtins[b].name, args[0]) != 0) {
             continue;
         }
+        if (builtins[b].opts == NULL) {
+            return &builtins[b];
+        }
+        for (int i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+            if (args[i][1] == '-' || strspn(args[i] + 1, builtins[b].opts) != strlen(args[i] + 1)) {
+                return NULL;  // "--" or an option we do not implement
+            }
+            if (builtins[b].fn == builtin_echo) {
+                break;  // echo only looks at its first argument
+            }
+        }
+        return &builtins[b];
+    }
+    return NULL;
+}
 
-        if (strncmp(inString, "bg", 2) == 0) {
-            bg_command();
-            free(inString);
-            continue;
+static void builtin_sigint(int sig) {
+    builtin_interrupted = 1;
+}
+
+// Whether a builtin takes input from the shell's stdin: cat or wc with no
+// file operands, or with "-" among them, and no < redirection
+static int builtin_reads_stdin(const Builtin *b, char **args) {
+    int operands = 0, dash = 0;
+
+    if (b->fn != builtin_cat && b->fn != builtin_wc) {
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i] == redir_in_token) {
+            return 0;
         }
+        if (args[i] == redir_out_token) {
+            if (args[i + 1] == NULL) {
+                break;
+            }
+            i++;  // The output file is no operand
+        } else if (strcmp(args[i], "-") == 0) {
+            dash = 1;
+        } else if (args[i][0] != '-') {
+            operands++;
+        }
+    }
+    return operands == 0 || dash;
+}
+
+// Run a lone foreground command inside the shell if a builtin covers it,
+// honoring its < and > redirections. Returns 0 if it ran, -1 if the
+// command should be launched as usual. That includes a builtin reading
+// stdin: it can wait on the terminal indefinitely, and only a job of its
+// own can be stopped with Ctrl-Z.
+int run_builtin(YshContext *ctx, char **args) {
+    struct sigaction sa, old;
+    int in_fd, out_fd;
+
+    const Builtin *b = builtin_lookup(ctx, args);
+    if (b == NULL || builtin_reads_stdin(b, args)) {
+        return -1;
+    }
+    if (redirection(args, &in_fd, &out_fd) < 0) {
+        ctx->last_status = 1;
+        return 0;
+    }
+
+    // Ctrl-C ends a builtin working through a large file: no SA_RESTART,
+    // so its reads and writes return EINTR
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = builtin_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+    builtin_interrupted = 0;
+
+    fflush(stdout);
+    ctx->last_status = b->fn(args, in_fd != -1 ? in_fd : STDIN_FILENO, out_fd != -1 ? out_fd : STDOUT_FILENO);
+
+    sigaction(SIGINT, &old, NULL);
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    return 0;
+}
 
-        if (strstr(inString, "&") != NULL) {
-            if_bg = 1;
-            inString[strcspn(inString, "&")] = '\0';  // Remove `&`
+// enable           list builtins and whether they are on
+// enable NAME...   use the builtin for NAME again
+// enable -n NAME.. run the external NAME instead
+void enable_command(YshContext *ctx, char **args) {
+    int on = 1;
+    int i = 1;
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        on = 0;
+        i++;
+    }
+    if (args[i] == NULL) {
+        for (int b = 0; b < BUILTIN_COUNT; b++) {
+            if (on || !BUILTIN_ON(ctx, b)) {
+                printf("enable %s%s\n", BUILTIN_ON(ctx, b) ? "" : "-n ", builtins[b].name);
+            }
         }
+        return;
+    }
+    for (; args[i] != NULL; i++) {
+        int found = 0;
+        for (int b = 0; b < BUILTIN_COUNT; b++) {
+            if (strcmp(builtins[b].name, args[i]) == 0) {
+                if (on) {
+                    ctx->builtins_off &= ~(1u << b);
+                } else {
+                    ctx->builtins_off |= 1u << b;
+                }
+                found = 1;
+            }
+        }
+        if (!found) {
+            printf("enable: %s: not a shell builtin\n", args[i]);
+        }
+    }
+}
 
-        if (split_pipe(inString, &left_cmd, &right_cmd)) {
-            // If a pipe is found, split and handle the pipe
-            char **parsed_left_cmd = parse_command(left_cmd);
-            char **parsed_right_cmd = parse_command(right_cmd);
+// Errors that mean the program itself could not be executed
+static int is_exec_error(int err) {
+    return err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR ||
+           err == ELOOP || err == ENAMETOOLONG || err == E2BIG || err == ETXTBSY;
+}
+
+// Fast path: posix_spawn() (clone(CLONE_VM|CLONE_VFORK) in glibc) avoids
+// copying the shell's page tables. Returns 0 or an errno value.
+static int spawn_command(const char *path, char **args, pid_t pgid, int in_fd, int out_fd, int foreground,
+                         const sigset_t *mask, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF;
+    int take_terminal = foreground && isatty(STDIN_FILENO);
+    int err;
+
+#ifndef HAVE_SPAWN_TCSETPGRP
+    if (take_terminal) {
+        return ENOTSUP;  // The child could read the tty before we hand it over
+    }
+#endif
 
-            do_pipe(parsed_left_cmd, parsed_right_cmd);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
 
-            if (if_bg) {
-                // Add piped command as a background job using the first process's PGID
-                add_job(pipe_pids[0], inString, RUNNING, 0);
-            } else {
-                foreground_pid = cpid;
-                //tcsetpgrp(STDIN_FILENO, getpid());  // Return control to the shell
-                foreground_pid = -1;
+#ifdef HAVE_SPAWN_TCSETPGRP
+    if (take_terminal) {
+        // Done while stdin is still the terminal, before the dup2()s below
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGTTIN);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (mask != NULL) {
+        posix_spawnattr_setsigmask(&attr, mask);
+        flags |= POSIX_SPAWN_SETSIGMASK;
+    }
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, flags);
+
+    err = posix_spawn(pid, path, &actions, &attr, args, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return err;
+}
+
+// Fallback: classic fork() + execvp(). With a builtin the child runs it
+// directly instead of exec'ing anything.
+static pid_t fork_command(const char *path, const Builtin *builtin, char **args, pid_t pgid, int in_fd, int out_fd,
+                          int foreground, const sigset_t *mask) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (mask != NULL) {
+            sigprocmask(SIG_SETMASK, mask, NULL);
+        }
+        setpgid(0, pgid);
+        if (foreground) {
+            give_terminal(getpgrp());
+        }
+        reset_child_signals();
+        if (in_fd != -1) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (builtin != NULL) {
+            // No exec to drop the close-on-exec pipe ends: a stage still
+            // holding its own pipe's read end would never see EPIPE
+            closefrom(STDERR_FILENO + 1);
+            reset_forked_signals();
+            _exit(builtin->fn(args, STDIN_FILENO, STDOUT_FILENO));
+        }
+        execv(path, args);
+        perror("execvp failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == -1) {
+        perror("fork failed");
+    }
+    return pid;
+}
+
+// Start one command in process group pgid (0 = a new group led by the
+// command). stdin/stdout come from in_fd/out_fd when not -1, and any < / >
+// redirections in args take precedence. Pipe fds must be close-on-exec.
+// mask is the signal mask the command should start with (NULL = ours).
+// Returns the child's pid, or -1 if nothing was started.
+pid_t launch_command(YshContext *ctx, char **args, pid_t pgid, int in_fd, int out_fd, int foreground, const sigset_t *mask) {
+    int file_in, file_out;
+    pid_t pid = -1;
+
+    // "command NAME" skips the builtins and runs the program
+    int external = (args[0] != NULL && strcmp(args[0], "command") == 0);
+    if (external) {
+        args++;
+    }
+    if (args[0] == NULL) {
+        return -1;
+    }
+    if (redirection(args, &file_in, &file_out) < 0) {
+        return -1;
+    }
+    if (file_in != -1) {
+        in_fd = file_in;
+    }
+    if (file_out != -1) {
+        out_fd = file_out;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const Builtin *builtin = external ? NULL : builtin_lookup(ctx, args);
+    int err = ENOENT;
+    if (builtin != NULL) {
+        pid = fork_command(NULL, builtin, args, pgid, in_fd, out_fd, foreground, mask);
+        err = 0;
+    }
+    for (int attempt = 0; builtin == NULL && attempt < 2 && err == ENOENT; attempt++) {
+        const char *path = hash_lookup(ctx, args[0]);
+        if (path == NULL) {
+            break;
+        }
+        err = (getenv("YSH_NOSPAWN") != NULL) ? ENOTSUP
+              : spawn_command(path, args, pgid, in_fd, out_fd, foreground, mask, &pid);
+        if (err == ENOTSUP || (err != 0 && !is_exec_error(err))) {
+            pid = fork_command(path, NULL, args, pgid, in_fd, out_fd, foreground, mask);
+            err = 0;
+        } else if (err == ENOENT) {
+            hash_forget(ctx, args[0]);  // Stale entry: the file moved, search PATH again
+        }
+    }
+    if (err != 0) {
+        fprintf(stderr, "execvp failed: %s\n", strerror(err));
+        pid = -1;
+    }
+
+    if (pid > 0) {
+        setpgid(pid, pgid ? pgid : pid);  // Also done in the child; whichever runs first wins
+        if (ctx->io.launched != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ctx->io.launched(ctx, (end.tv_sec - start.tv_sec) * 1000000UL + (end.tv_nsec - start.tv_nsec) / 1000,
+                             ctx->io.user);
+        }
+    }
+    if (file_in != -1) {
+        close(file_in);
+    }
+    if (file_out != -1) {
+        close(file_out);
+    }
+    return pid;
+}
+
+// Optional pipe tuning taken from the environment:
+//   YSH_PIPESZ=<bytes>  enlarge every pipeline pipe with F_SETPIPE_SZ
+//   YSH_SPLICE=1        have the shell splice() data between stages itself
+static void tune_pipe(int fd) {
+#ifdef F_SETPIPE_SZ
+    char *size = getenv("YSH_PIPESZ");
+    if (size != NULL && atoi(size) > 0) {
+        fcntl(fd, F_SETPIPE_SZ, atoi(size));
+    }
+#endif
+}
+
+static int open_pipe(int pfd[2]) {
+    if (pipe2(pfd, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        return -1;
+    }
+    tune_pipe(pfd[1]);
+    return 0;
+}
+
+// Move everything from one pipe to the next without copying through user space
+static void splice_relay(int in_fd, int out_fd) {
+#ifdef SPLICE_F_MOVE
+    ssize_t n;
+    while ((n = splice(in_fd, NULL, out_fd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+        ;
+    if (n == 0 || errno == EPIPE) {
+        return;
+    }
+#endif
+    // splice() unavailable: fall back to a plain copy loop
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(in_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < r; ) {
+            ssize_t w = write(out_fd, buf + off, r - off);
+            if (w <= 0) {
+                return;
             }
+            off += w;
+        }
+    }
+}
+
+// Handle pipe commands: run every stage in one process group, wiring
+// stage i's stdout to stage i+1's stdin. Returns the pipeline's PGID.
+pid_t do_pipe(YshContext *ctx, Pipeline *pl, int background, char *command) {
+    char *relay = getenv("YSH_SPLICE");
+    int use_relay = (relay != NULL && strcmp(relay, "0") != 0);
+    pid_t pgid = 0;
+    pid_t last = -1;  // Last stage, whose exit status is the pipeline's
+    int children = 0;
+    int in_fd = -1;  // Read end feeding the next stage
+
+    for (int i = 0; i < pl->count; i++) {
+        char **args = pl->stages[i];
+        int pfd[2] = { -1, -1 };
 
-            free(parsed_left_cmd);
-            free(parsed_right_cmd);
+        if (i < pl->count - 1 && open_pipe(pfd) == -1) {
+            break;
         }
-        else if ((strstr(inString, "<") != NULL) || (strstr(inString, ">") != NULL)){
-            parsedcmd = parse_command(inString);
-            cpid = fork();
 
-            if (cpid == 0) {
-                setpgid(0, 0);  // Set PGID to the child's PID
-                redirection(parsedcmd);
-                execvp(parsedcmd[0], parsedcmd);
-                perror("execvp failed");
-                exit(EXIT_FAILURE);
-            } else {
-                setpgid(cpid, cpid);  // Set the PGID of the child to its PID
-                if (if_bg) {
-                    // If it's a background task, add to jobs list
-                    add_job(cpid, inString, RUNNING, 0);
-                } else {
-                    // Foreground task
-                    foreground_pid = cpid;
+        pid_t pid = launch_command(ctx, args, pgid, in_fd, pfd[1], !background, NULL);
 
-                    waitpid(cpid, NULL, 0);  // Wait for the foreground process to finish
-                    //tcsetpgrp(STDIN_FILENO, getpid());  // Return control to the shell
-                    foreground_pid = -1;
+        if (i == pl->count - 1) {
+            last = pid;
+        }
+        if (pid > 0) {
+            if (pgid == 0) {
+                pgid = pid;
+                if (!background) {
+                    give_terminal(pgid);
                 }
             }
+            children++;
         }
-        else {
-            parsedcmd = parse_command(inString);  // Parse the command into arguments
-            cpid = fork();
 
-            if (cpid == 0) {
-                setpgid(0, 0);  //set pgid to child's pid
-                execvp(parsedcmd[0], parsedcmd);
-                perror("execvp failed");
-                exit(EXIT_FAILURE);
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (pfd[1] != -1) {
+            close(pfd[1]);
+        }
+        in_fd = pfd[0];
+
+        // Splice mode: put a relay between this stage and the next
+        if (use_relay && in_fd != -1) {
+            int rfd[2];
+            if (open_pipe(rfd) == -1) {
+                break;
+            }
+            pid_t rpid = fork();
+            if (rpid == 0) {
+                setpgid(0, pgid);
+                reset_forked_signals();  // Ctrl-C and Ctrl-Z reach the relay like any stage
+                close(rfd[0]);
+                splice_relay(in_fd, rfd[1]);
+                _exit(0);
+            }
+            if (rpid > 0) {
+                setpgid(rpid, pgid);
+                children++;
+            } else {
+                perror("fork failed");
             }
-            else if (cpid > 0) {  // Parent process
-                setpgid(cpid, cpid);
+            close(in_fd);
+            close(rfd[1]);
+            in_fd = rfd[0];
+        }
+    }
 
-                if (if_bg) {
-                    add_job(cpid, inString, RUNNING,0);  // Add the job to the jobs list
-                } else {
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+
+    ctx->last_status = (pgid > 0 || background) ? 0 : 127;
+    if (pgid > 0) {
+        Job *job = add_job(ctx, pgid, command, RUNNING, children, 0);
+        if (job != NULL) {
+            job->last_pid = last;
+            job->exit_status = (last > 0) ? 0 : 127;
+        }
+        if (job != NULL && !background) {
+            wait_for_job(ctx, job);
+        }
+    }
+
+    return pgid;
+}
+
+// Empty the arena and make sure it holds at least need bytes. Growing
+// happens only here, so pointers handed out for a line never move.
+int arena_reset(Arena *a, size_t need) {
+    if (need > a->cap) {
+        size_t cap = a->cap ? a->cap : 4096;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *base = malloc(cap);
+        if (base == NULL) {
+            return -1;
+        }
+        free(a->base);
+        a->base = base;
+        a->cap = cap;
+    }
+    a->used = 0;
+    return 0;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (a->used + size > a->cap) {
+        return NULL;
+    }
+    void *p = a->base + a->used;
+    a->used += size;
+    return p;
+}
 
-                    pid_t shell_pgrp = tcgetpgrp(STDIN_FILENO);
-                    if (shell_pgrp != getpid()) {
-                        printf("Shell is not in control of the terminal\n");
-                    }
+// Parsing commands: split a line into pipeline stages in one pass. Words
+// are unquoted in place inside line; the argument vectors come from the
+// arena, so nothing needs freeing. '|', '<', '>' and '&' are operators
+// unless quoted or escaped. Returns 0, or -1 after reporting a syntax error.
+int parse_line(char *line, Arena *a, Pipeline *pl) {
+    size_t len = strlen(line);
+    // Every token but the first costs at least one byte of the line, and
+    // each stage adds one NULL terminator
+    size_t slots = 2 * len + 2;
+
+    pl->count = 0;
+    pl->background = 0;
+    if (arena_reset(a, (slots + len + 1) * sizeof(char *) + 2 * sizeof(void *)) < 0) {
+        perror("malloc failed");
+        return -1;
+    }
+    pl->stages = arena_alloc(a, (len + 1) * sizeof(char **));
+    char **out = arena_alloc(a, slots * sizeof(char *));
 
-                    foreground_pid = cpid;
-                    //tcsetpgrp(STDIN_FILENO, cpid);
+    char **stage = out;
+    char *p = line;
+    char held = 0;        // Operator whose byte was overwritten by a word's terminator
+    char pending = 0;     // Redirection still waiting for its file name
 
-                    int status;
-                    waitpid(cpid, &status, WUNTRACED); // Wait for the foreground job to finish
-                    //tcsetpgrp(STDIN_FILENO, getpid());  // Return control to the shell
-                    foreground_pid = -1;
+    while (1) {
+        char c = held ? held : *p;
+        held = 0;
+
+        if (c == ' ' || c == '\t') {
+            p++;
+            continue;
+        }
+        if (c == '\0' || c == '|' || c == '&') {
+            if (pending) {
+                printf("ysh: syntax error near '%c'\n", pending);
+                return -1;
+            }
+            *out++ = NULL;
+            if (stage[0] == NULL && (c == '|' || pl->count > 0)) {
+                printf("ysh: syntax error near '|'\n");
+                return -1;
+            }
+            pl->stages[pl->count++] = stage;
+            if (c != '|') {
+                pl->background = (c == '&');  // Anything after '&' is ignored
+                break;
+            }
+            p++;
+            stage = out;
+            continue;
+        }
+        if (c == '<' || c == '>') {
+            if (pending) {
+                printf("ysh: syntax error near '%c'\n", c);
+                return -1;
+            }
+            *out++ = (c == '<') ? redir_in_token : redir_out_token;
+            pending = c;
+            p++;
+            continue;
+        }
+
+        // A word: copy it down over its quotes and escapes
+        char *dst = p;
+        char quote = 0;
+        *out++ = dst;
+        pending = 0;
+        while (*p != '\0') {
+            if (quote) {
+                if (*p == quote) {
+                    quote = 0;
+                    p++;
+                } else if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+                    p++;
+                    *dst++ = *p++;
+                } else {
+                    *dst++ = *p++;
                 }
+            } else if (*p == '\'' || *p == '"') {
+                quote = *p++;
+            } else if (*p == '\\' && p[1] != '\0') {
+                p++;
+                *dst++ = *p++;
+            } else if (strchr(" \t|<>&", *p) != NULL) {
+                break;
             } else {
-                perror("fork failed");
+                *dst++ = *p++;
+            }
+        }
+        if (quote) {
+            printf("ysh: unterminated quote\n");
+            return -1;
+        }
+        if (dst == p) {
+            held = *p;  // The terminator lands on the operator that ended the word
+        }
+        *dst = '\0';
+    }
+    return 0;
+}
+
+// Signal handlers
+void sigint_handler(int sig) {
+    // Handle Ctrl+C (SIGINT)
+    YshContext *ctx = signal_ctx;
+    if (ctx != NULL && ctx->foreground_pid > 0) {
+        kill(-ctx->foreground_pid, SIGINT);  // Send SIGINT to the foreground job
+    }
+}
+
+void sigtstp_handler(int sig) {
+    // Handle Ctrl+Z (SIGTSTP)
+    YshContext *ctx = signal_ctx;
+    if (ctx != NULL && ctx->foreground_pid > 0) {
+        kill(-ctx->foreground_pid, SIGTSTP);  // Suspend the foreground job
+    }
+}
+
+void sigchld_handler(int sig) {
+    // Only note it; reap_jobs() does the work outside signal context
+    sigchld_pending = 1;
+}
+
+static char *readline_input(void *user, const char *prompt) {
+    return readline(prompt);
+}
+
+// Set up a fresh shell. io may be NULL (or leave hooks NULL) to read lines
+// with readline() and run them with ysh_eval().
+void ysh_init(YshContext *ctx, const YshIO *io) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->foreground_pid = -1;
+    if (io != NULL) {
+        ctx->io = *io;
+    }
+    if (ctx->io.read_line == NULL) {
+        ctx->io.read_line = readline_input;
+    }
+    ctx->next = contexts;
+    contexts = ctx;
+}
+
+// Release everything a context owns. Its jobs keep running untracked.
+void ysh_free(YshContext *ctx) {
+    YshContext **link = &contexts;
+    while (*link != NULL && *link != ctx) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = ctx->next;
+    }
+    if (signal_ctx == ctx) {
+        signal_ctx = NULL;
+    }
+    while (ctx->jobs.slabs != NULL) {
+        JobSlab *slab = ctx->jobs.slabs;
+        ctx->jobs.slabs = slab->next;
+        free(slab);
+    }
+    hash_reset(ctx);
+    free(ctx->hashed_path_env);
+    free(ctx->current_command_line);
+    free(ctx->arena.base);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+// Run one command line and return its exit status (also kept as the
+// context's last status). line is parsed in place; the caller still owns it.
+int ysh_eval(YshContext *ctx, char *line) {
+    int cpid;
+    char **parsedcmd;
+    Pipeline pl;
+
+    signal_ctx = ctx;
+    if (ctx->current_command_line != NULL) {
+        free(ctx->current_command_line);
+    }
+    ctx->current_command_line = strdup(line);
+
+    // Tokenize once; line is rewritten in place
+    if (parse_line(line, &ctx->arena, &pl) < 0) {
+        return ctx->last_status = 2;
+    }
+    parsedcmd = pl.stages[0];
+    if (parsedcmd[0] == NULL) {
+        return ctx->last_status;
+    }
+
+    if (pl.count == 1 && strcmp(parsedcmd[0], "jobs") == 0) {
+        list_jobs(ctx, parsedcmd[1] != NULL && strcmp(parsedcmd[1], "-v") == 0);
+        return ctx->last_status = 0;
+    }
+
+    if (pl.count == 1 && strcmp(parsedcmd[0], "hash") == 0) {
+        hash_command(ctx, parsedcmd);
+        return ctx->last_status = 0;
+    }
+
+    if (pl.count == 1 && strcmp(parsedcmd[0], "enable") == 0) {
+        enable_command(ctx, parsedcmd);
+        return ctx->last_status = 0;
+    }
+
+    // A lone foreground echo/true/cat/wc runs without any new process
+    if (pl.count == 1 && !pl.background && run_builtin(ctx, parsedcmd) == 0) {
+        return ctx->last_status;
+    }
+
+    if (pl.count == 1 && (strcmp(parsedcmd[0], "fg") == 0 || strcmp(parsedcmd[0], "bg") == 0)) {
+        if (parsedcmd[0][0] == 'f') {
+            fg_command(ctx, parsedcmd[1]);
+        } else {
+            bg_command(ctx, parsedcmd[1]);
+        }
+        return ctx->last_status;
+    }
+
+    if (pl.count > 1) {
+        // Run every stage as one pipeline job
+        do_pipe(ctx, &pl, pl.background, ctx->current_command_line);
+    }
+    else {
+        cpid = launch_command(ctx, parsedcmd, 0, -1, -1, !pl.background, NULL);
+        ctx->last_status = (cpid > 0) ? 0 : 127;
+
+        if (cpid > 0) {
+            Job *job = add_job(ctx, cpid, ctx->current_command_line, RUNNING, 1, 0);  // Add the job to the jobs list
+            if (job != NULL) {
+                job->last_pid = cpid;
             }
+            if (job != NULL && !pl.background) {
+                pid_t shell_pgrp = tcgetpgrp(STDIN_FILENO);
+                if (shell_pgrp != -1 && shell_pgrp != getpid() && shell_pgrp != cpid) {
+                    printf("Shell is not in control of the terminal\n");
+                }
 
-            free(parsedcmd);
+                wait_for_job(ctx, job);  // Wait for the foreground job to finish or stop
+            }
         }
+    }
+    return ctx->last_status;
+}
 
+// Read-eval loop: pull lines from the context's input callback until it
+// runs dry
+void ysh_loop(YshContext *ctx) {
+    char *inString;
+
+    // Setup signal handlers
+    signal(SIGINT, sigint_handler);    // Handle Ctrl+C
+    signal(SIGTSTP, sigtstp_handler);  // Handle Ctrl+Z
+    signal(SIGCHLD, sigchld_handler);  // Handle child process cleanup
+    signal(SIGTTOU, SIG_IGN);          // Allow handing the terminal back and forth
+    signal(SIGTTIN, SIG_IGN);
+
+    signal_ctx = ctx;
+    while (reap_jobs(), (inString = ctx->io.read_line(ctx->io.user, "# "))) {
+        if (ctx->io.run_line != NULL) {
+            ctx->io.run_line(ctx, inString, ctx->io.user);
+        } else {
+            ysh_eval(ctx, inString);
+        }
         free(inString);
     }
 }
@@ -1,15 +1,17 @@
 // ysh.h: Header file for ysh.c
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#include <signal.h>
 
 #ifndef YSH_H
 #define YSH_H
 
-#define MAX_ARGS 10
-#define MAX_JOBS 20
-#define MAX_PIDS 10
-#define STACK_SIZE 100
+#define JOB_SLAB 64       // Jobs allocated at a time
+#define JOB_BUCKETS 256   // Hash buckets for the pgid and job id indexes
+#define PATH_BUCKETS 64   // Hash buckets for the executable path cache
 
 // Job status enum for tracking running, suspended, or done jobs
 typedef enum { RUNNING, SUSPENDED, DONE } JobStatus;
@@ -19,18 +21,99 @@ typedef struct _Job {
     int job_id;
     pid_t pgid;        // Process group ID
     JobStatus status;  // Status of the job
+    int live;          // Processes in the group not yet reaped
     char command[256]; // Command associated with the job
-    struct _Job* next; // Pointer to the next job in the list
+    struct _Job* next; // Next job in job id order (or next free slot)
+    struct _Job* prev;
+    struct _Job* pgid_next;  // Hash chain in the pgid index
+    struct _Job* id_next;    // Hash chain in the job id index
+    struct _Job* stop_next;  // Stopped jobs, most recently stopped first
+    struct _Job* stop_prev;
+    int on_stopped_list;
+    pid_t last_pid;    // Last process of the pipeline; its status is the job's
+    int exit_status;
+    struct rusage usage;     // Summed over the job's processes reaped so far
+    struct timeval started;
 } Job;
 
-// Declare global variables
-extern pid_t stopped_stack[STACK_SIZE];
-extern int stack_top;
-extern pid_t foreground_pid;
-extern Job *head;
-extern Job *tail;
-extern int job_count;
-extern char *current_command_line;
+typedef struct _JobSlab {
+    struct _JobSlab *next;
+    Job jobs[JOB_SLAB];
+} JobSlab;
+
+// Job table: slab-allocated jobs indexed by pgid and by job id
+typedef struct {
+    Job *by_pgid[JOB_BUCKETS];
+    Job *by_id[JOB_BUCKETS];
+    Job *head;         // All jobs in job id order
+    Job *tail;
+    Job *stopped;      // Head of the stopped-job recency list (the "+" job)
+    Job *free_list;    // Recycled slab entries
+    JobSlab *slabs;    // Every slab, for freeing the table
+    int count;
+} JobTable;
+
+// One remembered command for the "hash" builtin
+typedef struct _PathEntry {
+    char *name;
+    char *path;
+    unsigned hits;
+    struct _PathEntry *next;
+} PathEntry;
+
+// A parsed pipeline: stage i's stdout feeds stage i+1's stdin
+typedef struct {
+    char ***stages;    // NULL-terminated argument vector per stage
+    int count;         // Number of stages
+    int background;    // Line ended in '&'
+} Pipeline;
+
+// In-process utility: reads in_fd, writes out_fd, returns an exit status
+typedef struct {
+    const char *name;
+    int (*fn)(char **args, int in_fd, int out_fd);
+    const char *opts;  // Options it implements; others run the real program
+} Builtin;
+
+// Bump allocator holding everything parsed from one command line.
+// Reset before each line; grows only when a longer line arrives.
+typedef struct {
+    char *base;
+    size_t cap;
+    size_t used;
+} Arena;
+
+struct _YshContext;
+
+// How a driver feeds ysh_loop(). read_line returns a malloc()ed line
+// without the newline, or NULL at end of input. run_line, if set, runs
+// each line in place of ysh_eval() (and normally calls it). launched, if
+// set, is told how many microseconds each command took to start: the
+// fork or posix_spawn() up to the point the shell has its pid.
+typedef struct {
+    char *(*read_line)(void *user, const char *prompt);
+    int (*run_line)(struct _YshContext *ctx, char *line, void *user);
+    void *user;
+    void (*launched)(struct _YshContext *ctx, unsigned long usec, void *user);
+} YshIO;
+
+// Everything one shell owns, so several can run in one process. Only the
+// signal plumbing in ysh.c is shared between them.
+typedef struct _YshContext {
+    JobTable jobs;
+    pid_t foreground_pid;        // Job that Ctrl+C / Ctrl+Z go to, -1 if none
+    char *current_command_line;  // Line being run, as typed
+    Arena arena;                 // Parsed form of that line
+    PathEntry *path_table[PATH_BUCKETS];
+    char *hashed_path_env;       // PATH the table was built from
+    unsigned builtins_off;       // Bit per builtin turned off by "enable -n"
+    int last_status;             // Exit status of the last command line
+    struct rusage usage;         // Every finished job of this shell, summed
+    struct rusage last_usage;    // The last foreground job to finish
+    unsigned long jobs_done;     // Finished jobs counted in usage
+    YshIO io;
+    struct _YshContext *next;    // Other live contexts
+} YshContext;
 
 // Declare signal handler functions so server.c can use them
 void sigint_handler(int sig);    // Handle Ctrl+C (SIGINT)
@@ -38,24 +121,42 @@ void sigtstp_handler(int sig);   // Handle Ctrl+Z (SIGTSTP)
 void sigchld_handler(int sig);   // Handle child process cleanup
 
 // Function declarations for job control
-void push(pid_t pid);
-pid_t pop();
-pid_t peek();
-void add_job(pid_t pgid, char *command, JobStatus status, int print);
-void remove_job(pid_t pid);
-Job* find_job(pid_t pgid);
-void list_jobs();
-void fg_command();
-void bg_command();
+Job *add_job(YshContext *ctx, pid_t pgid, char *command, JobStatus status, int procs, int print);
+void remove_job(YshContext *ctx, pid_t pgid);
+Job* find_job(YshContext *ctx, pid_t pgid);
+Job* find_job_by_id(YshContext *ctx, int job_id);
+void reap_jobs();
+void wait_for_job(YshContext *ctx, Job *job);
+void list_jobs(YshContext *ctx, int verbose);
+void fg_command(YshContext *ctx, char *arg);
+void bg_command(YshContext *ctx, char *arg);
 
 // Command and execution handling
-int redirection(char **args);
-int do_pipe(char **left_cmd, char **right_cmd);
-char **parse_command(char *command);
-int split_pipe(char *command, char **left_cmd, char **right_cmd);
+void give_terminal(pid_t pgid);
+int redirection(char **args, int *in_fd, int *out_fd);
+pid_t launch_command(YshContext *ctx, char **args, pid_t pgid, int in_fd, int out_fd, int foreground,
+                     const sigset_t *mask);
+pid_t do_pipe(YshContext *ctx, Pipeline *pl, int background, char *command);
+int arena_reset(Arena *a, size_t need);
+void *arena_alloc(Arena *a, size_t size);
+int parse_line(char *line, Arena *a, Pipeline *pl);
+
+// Executable path cache ("hash" builtin)
+const char *hash_lookup(YshContext *ctx, const char *name);
+void hash_reset(YshContext *ctx);
+void hash_command(YshContext *ctx, char **args);
+
+// Builtin utilities ("enable" builtin)
+const Builtin *builtin_lookup(YshContext *ctx, char **args);
+int run_builtin(YshContext *ctx, char **args);
+void enable_command(YshContext *ctx, char **args);
 
-// Main loop for the ysh shell
-void ysh_loop();  // Declaration of the main ysh loop
+// Shell engine: set up a context, then feed it lines or let ysh_loop()
+// pull them from its YshIO
+void ysh_init(YshContext *ctx, const YshIO *io);
+void ysh_free(YshContext *ctx);
+int ysh_eval(YshContext *ctx, char *line);
+void ysh_loop(YshContext *ctx);  // Declaration of the main ysh loop
 
 #endif
 
@@ -0,0 +1,14 @@
+// ysh_main.c: Standalone ysh on the current terminal, running the same
+// engine yashd runs on each session's pty
+
+#include <stdlib.h>
+#include "ysh.h"
+
+int main(void) {
+    YshContext shell;
+
+    ysh_init(&shell, NULL);
+    ysh_loop(&shell);
+    ysh_free(&shell);
+    return EXIT_SUCCESS;
+}